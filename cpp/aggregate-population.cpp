@@ -1,11 +1,30 @@
 #include <iostream>
 #include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <memory>
+#include <limits>
+#include <iomanip>
+#include <cstdint>
 #include <math.h>
 #include <cassert>
 #include <stdio.h>
+#include <ctime>
+#include <sys/stat.h>
+
+#include "boost/program_options.hpp"
+#include "boost/filesystem.hpp"
+#include "boost/filesystem/fstream.hpp"
 
 #include "gdal_priv.h"
 #include "cpl_conv.h"
+#include "gdal_alg.h"
+#include "ogr_api.h"
+#include "ogr_geometry.h"
 
 #define UNUSED(x) (void)(x)
 
@@ -22,15 +41,290 @@ void closeRaster(GDALDataset* rasterDataSet) {
   GDALClose(rasterDataSet);
 };
 
-int main(int argc, char *argv[]) {
-  GDALAllRegister();
+// Sum, max, min and count of the valid pixels of a block (or of a set of
+// blocks). The max starts at zero, as always reported.
+struct Aggregate {
+  double sum;
+  float max;
+  float min;
+  uint64_t count;
+
+  Aggregate() : sum(0), max(0), min(std::numeric_limits<float>::infinity()), count(0) {}
+};
+
+// Mergeable streaming quantile sketch after DDSketch: values are counted in
+// buckets of logarithmically growing width, so that any quantile is within
+// SKETCH_ACCURACY relative error of the exact one. Counts are integers, so
+// merging sketches in any order gives the same result.
+const double SKETCH_ACCURACY = 0.01;
+
+class QuantileSketch {
+public:
+  QuantileSketch() : zeros(0),
+                     gamma((1 + SKETCH_ACCURACY) / (1 - SKETCH_ACCURACY)),
+                     logGamma(log(gamma)) {}
+
+  void add(float value) {
+    if (value > 0) {
+      positives.add(bucket(value));
+    } else if (value < 0) {
+      negatives.add(bucket(-value));
+    } else if (value == 0) {
+      ++zeros;
+    }
+  }
+
+  void merge(const QuantileSketch& other) {
+    positives.merge(other.positives);
+    negatives.merge(other.negatives);
+    zeros += other.zeros;
+  }
+
+  uint64_t count() const {
+    return positives.total + negatives.total + zeros;
+  }
+
+  // value of rank q * (count - 1) among the counted ones
+  double quantile(double q) const {
+    uint64_t rank = (uint64_t) (q * (count() - 1));
+    for (int i = (int) negatives.counts.size() - 1; i >= 0; --i) {
+      if (rank < negatives.counts[i]) return -value(negatives.offset + i);
+      rank -= negatives.counts[i];
+    }
+    if (rank < zeros) return 0;
+    rank -= zeros;
+    for (size_t i = 0; i < positives.counts.size(); ++i) {
+      if (rank < positives.counts[i]) return value(positives.offset + i);
+      rank -= positives.counts[i];
+    }
+    return 0;
+  }
+
+private:
+  // counts of the buckets from offset on
+  struct Store {
+    std::vector<uint64_t> counts;
+    int offset = 0;
+    uint64_t total = 0;
+
+    void add(int index, uint64_t n = 1) {
+      if (counts.empty()) {
+        offset = index;
+      }
+      if (index < offset) {
+        counts.insert(counts.begin(), offset - index, 0);
+        offset = index;
+      } else if (index >= offset + (int) counts.size()) {
+        counts.resize(index - offset + 1, 0);
+      }
+      counts[index - offset] += n;
+      total += n;
+    }
+
+    void merge(const Store& other) {
+      for (size_t i = 0; i < other.counts.size(); ++i) {
+        if (other.counts[i]) add(other.offset + i, other.counts[i]);
+      }
+    }
+  };
+
+  int bucket(double value) const { return (int) ceil(log(value) / logGamma); }
+  double value(int bucket) const { return 2 * pow(gamma, bucket) / (gamma + 1); }
+
+  Store positives, negatives;
+  uint64_t zeros;
+  double gamma, logGamma;
+};
+
+// Sums pairwise over [first, last) so that the rounding of the total only
+// depends on the order of the partials, not on how they were computed.
+Aggregate combineAggregates(const std::vector<Aggregate>& partials, size_t first, size_t last) {
+  if (last - first == 1) {
+    return partials[first];
+  }
+  Aggregate result;
+  if (last > first) {
+    size_t middle = first + (last - first) / 2;
+    Aggregate left = combineAggregates(partials, first, middle);
+    Aggregate right = combineAggregates(partials, middle, last);
+    result.sum = left.sum + right.sum;
+    result.max = std::max(left.max, right.max);
+    result.min = std::min(left.min, right.min);
+    result.count = left.count + right.count;
+  }
+  return result;
+}
+
+// Masked sum, max, min and count of one row of a block. Values are
+// accumulated in LANES independent partials which the compiler can keep in
+// vector registers, and which are then combined pairwise. Without a zone
+// mask every pixel with data is counted, otherwise only those with a non
+// zero mask.
+const int LANES = 8;
+
+struct Lanes {
+  double sums[LANES];
+  float maxs[LANES];
+  float mins[LANES];
+  uint32_t counts[LANES];
+
+  Lanes() {
+    std::fill(sums, sums + LANES, 0.0);
+    std::fill(maxs, maxs + LANES, 0.0f);
+    std::fill(mins, mins + LANES, std::numeric_limits<float>::infinity());
+    std::fill(counts, counts + LANES, 0);
+  }
+
+  inline void add(int k, float value, bool valid) {
+    sums[k] += valid ? value : 0.0f;
+    maxs[k] = std::max(maxs[k], valid ? value : 0.0f);
+    mins[k] = std::min(mins[k], valid ? value : std::numeric_limits<float>::infinity());
+    counts[k] += valid;
+  }
+};
 
-  if (argc < 2) {
-    std::cout << "Usage: aggregate-population RASTERFILE" << std::endl;
+inline bool isValid(float value, float nodata, const GByte* mask, int i) {
+  return value != nodata && (!mask || mask[i]);
+}
+
+template<bool MASKED>
+void aggregateRow(const float* values, const GByte* mask, int count, float nodata, Lanes& lanes) {
+  int i = 0;
+  for (; i + LANES <= count; i += LANES) {
+    for (int k = 0; k < LANES; ++k) {
+      lanes.add(k, values[i + k], isValid(values[i + k], nodata, MASKED ? mask : NULL, i + k));
+    }
+  }
+  for (int k = 0; i < count; ++i, ++k) {
+    lanes.add(k, values[i], isValid(values[i], nodata, MASKED ? mask : NULL, i));
+  }
+}
+
+Aggregate aggregateBlock(const float* buffer, const GByte* mask, int xBlockSize, int nXValid, int nYValid, float nodata) {
+  Lanes lanes;
+  for (int iY = 0; iY < nYValid; ++iY) {
+    if (mask) {
+      aggregateRow<true>(buffer + xBlockSize*iY, mask + xBlockSize*iY, nXValid, nodata, lanes);
+    } else {
+      aggregateRow<false>(buffer + xBlockSize*iY, NULL, nXValid, nodata, lanes);
+    }
+  }
+
+  for (int width = LANES / 2; width > 0; width /= 2) {
+    for (int k = 0; k < width; ++k) {
+      lanes.sums[k] += lanes.sums[k + width];
+      lanes.maxs[k] = std::max(lanes.maxs[k], lanes.maxs[k + width]);
+      lanes.mins[k] = std::min(lanes.mins[k], lanes.mins[k + width]);
+      lanes.counts[k] += lanes.counts[k + width];
+    }
+  }
+  Aggregate result;
+  result.sum = lanes.sums[0];
+  result.max = lanes.maxs[0];
+  result.min = lanes.mins[0];
+  result.count = lanes.counts[0];
+  return result;
+}
+
+void sketchBlock(QuantileSketch& sketch, const float* buffer, const GByte* mask, int xBlockSize, int nXValid, int nYValid, float nodata) {
+  for (int iY = 0; iY < nYValid; ++iY) {
+    for (int iX = 0; iX < nXValid; ++iX) {
+      int iBuff = xBlockSize*iY+iX;
+      if (isValid(buffer[iBuff], nodata, mask, iBuff)) {
+        sketch.add(buffer[iBuff]);
+      }
+    }
+  }
+}
+
+// Part of the raster to aggregate: the blocks overlapping the bounding box
+// of a polygon, or all of them for the whole raster (without polygon).
+struct Zone {
+  std::shared_ptr<OGRGeometry> geometry;
+  int firstXBlock, firstYBlock;
+  int nXBlocks, nYBlocks;
+
+  size_t blockCount() const { return (size_t) nXBlocks * nYBlocks; }
+};
+
+// Reads a polygon given as WKT or as a GeoJSON geometry, either directly or
+// in a file.
+std::shared_ptr<OGRGeometry> parsePolygon(std::string polygon) {
+  if (boost::filesystem::is_regular_file(polygon)) {
+    std::ifstream in(polygon);
+    std::stringstream contents;
+    contents << in.rdbuf();
+    polygon = contents.str();
+  }
+
+  OGRGeometry* geometry = NULL;
+  if (polygon.find('{') != std::string::npos) {
+    geometry = (OGRGeometry*) OGR_G_CreateGeometryFromJson(polygon.c_str());
+  } else {
+    char* wkt = (char*) polygon.c_str();
+    if (OGRGeometryFactory::createFromWkt(&wkt, NULL, &geometry) != OGRERR_NONE) {
+      geometry = NULL;
+    }
+  }
+  if (geometry == NULL) {
+    std::cout << "Failed parsing polygon: " << polygon << std::endl;
     exit(1);
   }
+  return std::shared_ptr<OGRGeometry>(geometry, OGRGeometryFactory::destroyGeometry);
+}
 
-  GDALDataset* dataset = openRaster(argv[1]);
+// Blocks of the raster overlapping the bounding box of the polygon, which
+// is expected in the raster coordinate system.
+Zone polygonZone(GDALDataset* dataset, std::shared_ptr<OGRGeometry> geometry) {
+  GDALRasterBand* band = dataset->GetRasterBand(1);
+  int xBlockSize, yBlockSize;
+  band->GetBlockSize(&xBlockSize, &yBlockSize);
+  double geoTransform[6];
+  dataset->GetGeoTransform(geoTransform);
+
+  OGREnvelope envelope;
+  geometry->getEnvelope(&envelope);
+  double x1 = (envelope.MinX - geoTransform[0]) / geoTransform[1];
+  double x2 = (envelope.MaxX - geoTransform[0]) / geoTransform[1];
+  double y1 = (envelope.MaxY - geoTransform[3]) / geoTransform[5];
+  double y2 = (envelope.MinY - geoTransform[3]) / geoTransform[5];
+  int xMin = std::max(0, (int) floor(std::min(x1, x2)));
+  int xMax = std::min(dataset->GetRasterXSize(), (int) ceil(std::max(x1, x2)));
+  int yMin = std::max(0, (int) floor(std::min(y1, y2)));
+  int yMax = std::min(dataset->GetRasterYSize(), (int) ceil(std::max(y1, y2)));
+
+  Zone zone;
+  zone.geometry = geometry;
+  zone.firstXBlock = xMin / xBlockSize;
+  zone.firstYBlock = yMin / yBlockSize;
+  zone.nXBlocks = xMax > xMin ? (xMax + xBlockSize - 1) / xBlockSize - zone.firstXBlock : 0;
+  zone.nYBlocks = yMax > yMin ? (yMax + yBlockSize - 1) / yBlockSize - zone.firstYBlock : 0;
+  return zone;
+}
+
+Zone rasterZone(GDALDataset* dataset) {
+  GDALRasterBand* band = dataset->GetRasterBand(1);
+  int xBlockSize, yBlockSize;
+  band->GetBlockSize(&xBlockSize, &yBlockSize);
+
+  Zone zone;
+  zone.firstXBlock = 0;
+  zone.firstYBlock = 0;
+  zone.nXBlocks = (dataset->GetRasterXSize() + xBlockSize - 1)/xBlockSize;
+  zone.nYBlocks = (dataset->GetRasterYSize() + yBlockSize - 1)/yBlockSize;
+  return zone;
+}
+
+// Reads and aggregates the blocks of all zones from the first band of the
+// raster, handing them out in order to the given number of threads. Each
+// thread opens the raster on its own since GDAL datasets cannot be shared
+// between threads. Polygons are rasterized into a mask one block at a
+// time, burning the pixels whose centre is inside. If sketches is given the
+// valid values of each zone are also added to a quantile sketch, one per
+// zone and thread, merged at the end.
+std::vector<Aggregate> aggregateZones(std::string filename, const std::vector<Zone>& zones, unsigned threads,
+                                      std::vector<QuantileSketch>* sketches = NULL) {
+  GDALDataset* dataset = openRaster(filename);
   GDALRasterBand* band = dataset->GetRasterBand(1);
 
   CPLAssert(band->GetRasterDataType() == GDT_Float32);
@@ -40,44 +334,347 @@ int main(int argc, char *argv[]) {
 
   int xSize = dataset->GetRasterXSize();
   int ySize = dataset->GetRasterYSize();
-  int nXBlocks = (xSize + xBlockSize - 1)/xBlockSize;
-  int nYBlocks = (ySize + yBlockSize - 1)/yBlockSize;
-  int nXValid, nYValid, xOffset, yOffset;
-
-  float* buffer = (float*) CPLMalloc(sizeof(float)*xBlockSize*yBlockSize);
   float nodata = band->GetNoDataValue();
-  float max = 0;
-  double sum = 0;
+  double geoTransform[6];
+  dataset->GetGeoTransform(geoTransform);
 
-  CPLErr err;
-  UNUSED(err);  // error checking disabled in release build
+  // blocks of zone i are tasks [zoneOffsets[i], zoneOffsets[i+1])
+  std::vector<size_t> zoneOffsets(1, 0);
+  for (const Zone& zone : zones) {
+    zoneOffsets.push_back(zoneOffsets.back() + zone.blockCount());
+  }
+  size_t nTasks = zoneOffsets.back();
+  std::vector<Aggregate> partials(nTasks);
+  std::atomic<size_t> nextTask(0);
+  std::vector<std::vector<QuantileSketch>> threadSketches(std::max(1u, std::min<unsigned>(threads, nTasks)));
+
+  auto worker = [&](GDALDataset* workerDataset, std::vector<QuantileSketch>& workerSketches) {
+    if (sketches) {
+      workerSketches.resize(zones.size());
+    }
+    GDALRasterBand* workerBand = workerDataset->GetRasterBand(1);
+    float* buffer = (float*) CPLMalloc(sizeof(float)*xBlockSize*yBlockSize);
+    GByte* mask = (GByte*) CPLMalloc(xBlockSize*yBlockSize);
+    GDALDataset* maskDataset = NULL;
 
-  for (int iYBlock = 0; iYBlock < nYBlocks; ++iYBlock) {
-    yOffset = iYBlock*yBlockSize;
-    nYValid = yBlockSize;
-    if (iYBlock == nYBlocks-1) nYValid = ySize - yOffset;
+    CPLErr err;
+    UNUSED(err);  // error checking disabled in release build
 
-    for (int iXBlock = 0; iXBlock < nXBlocks; ++iXBlock) {
-      xOffset = iXBlock*xBlockSize;
-      nXValid = xBlockSize;
-      if (iXBlock == nXBlocks-1) nXValid = xSize - xOffset;
+    for (size_t iTask = nextTask++; iTask < nTasks; iTask = nextTask++) {
+      size_t iZone = std::upper_bound(zoneOffsets.begin(), zoneOffsets.end(), iTask) - zoneOffsets.begin() - 1;
+      const Zone& zone = zones[iZone];
+      size_t iBlock = iTask - zoneOffsets[iZone];
+      int iXBlock = zone.firstXBlock + iBlock % zone.nXBlocks;
+      int iYBlock = zone.firstYBlock + iBlock / zone.nXBlocks;
+      int xOffset = iXBlock*xBlockSize;
+      int yOffset = iYBlock*yBlockSize;
+      int nXValid = std::min(xBlockSize, xSize - xOffset);
+      int nYValid = std::min(yBlockSize, ySize - yOffset);
 
-      err = band->ReadBlock(iXBlock, iYBlock, buffer);
+      err = workerBand->ReadBlock(iXBlock, iYBlock, buffer);
       assert(err == CE_None);
 
-      for (int iY = 0; iY < nYValid; ++iY) {
-        for (int iX = 0; iX < nXValid; ++iX) {
-          int iBuff = xBlockSize*iY+iX;
-          if (buffer[iBuff] != nodata) {
-            sum += buffer[iBuff];
-            if (buffer[iBuff] > max) {
-              max = buffer[iBuff];
-            }
-          }
+      if (zone.geometry) {
+        if (maskDataset == NULL) {
+          GDALDriver* memDriver = GetGDALDriverManager()->GetDriverByName("MEM");
+          maskDataset = memDriver->Create("", xBlockSize, yBlockSize, 1, GDT_Byte, NULL);
+        }
+        double blockTransform[6] = {
+          geoTransform[0] + xOffset*geoTransform[1] + yOffset*geoTransform[2], geoTransform[1], geoTransform[2],
+          geoTransform[3] + xOffset*geoTransform[4] + yOffset*geoTransform[5], geoTransform[4], geoTransform[5]
+        };
+        maskDataset->SetGeoTransform(blockTransform);
+        GDALRasterBand* maskBand = maskDataset->GetRasterBand(1);
+        maskBand->Fill(0);
+        int bandList[1] = { 1 };
+        double burnValue = 1;
+        OGRGeometryH geometry = (OGRGeometryH) zone.geometry.get();
+        err = GDALRasterizeGeometries(maskDataset, 1, bandList, 1, &geometry, NULL, NULL, &burnValue, NULL, NULL, NULL);
+        assert(err == CE_None);
+        err = maskBand->RasterIO(GF_Read, 0, 0, xBlockSize, yBlockSize, mask, xBlockSize, yBlockSize, GDT_Byte, 0, 0);
+        assert(err == CE_None);
+      }
+
+      const GByte* zoneMask = zone.geometry ? mask : NULL;
+      partials[iTask] = aggregateBlock(buffer, zoneMask, xBlockSize, nXValid, nYValid, nodata);
+      if (sketches) {
+        sketchBlock(workerSketches[iZone], buffer, zoneMask, xBlockSize, nXValid, nYValid, nodata);
+      }
+    }
+
+    if (maskDataset != NULL) {
+      closeRaster(maskDataset);
+    }
+    CPLFree(mask);
+    CPLFree(buffer);
+  };
+
+  threads = threadSketches.size();
+  std::vector<std::thread> pool;
+  for (unsigned i = 1; i < threads; ++i) {
+    pool.emplace_back([&, i]() {
+      GDALDataset* workerDataset = openRaster(filename);
+      worker(workerDataset, threadSketches[i]);
+      closeRaster(workerDataset);
+    });
+  }
+  worker(dataset, threadSketches[0]);
+  for (auto& thread : pool) {
+    thread.join();
+  }
+  closeRaster(dataset);
+
+  std::vector<Aggregate> results;
+  for (size_t i = 0; i < zones.size(); ++i) {
+    results.push_back(combineAggregates(partials, zoneOffsets[i], zoneOffsets[i+1]));
+  }
+  if (sketches) {
+    sketches->assign(zones.size(), QuantileSketch());
+    for (auto& workerSketches : threadSketches) {
+      for (size_t i = 0; i < workerSketches.size(); ++i) {
+        (*sketches)[i].merge(workerSketches[i]);
+      }
+    }
+  }
+  return results;
+}
+
+std::string jsonString(const std::string& value) {
+  std::string result = "\"";
+  for (char c : value) {
+    if (c == '"' || c == '\\') {
+      result += '\\';
+      result += c;
+    } else if ((unsigned char) c < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      result += escaped;
+    } else {
+      result += c;
+    }
+  }
+  return result + "\"";
+}
+
+// Statistics of a zone as the fields of a single line JSON object, which
+// follow the raster (and polygon) fields; min, mean and quantiles are null
+// if there are no valid pixels.
+std::string statisticsJson(const Aggregate& result, const QuantileSketch& sketch, const std::vector<double>& quantiles) {
+  std::ostringstream out;
+  out << std::setprecision(10);
+  out << ",\"sum\":" << result.sum << ",\"max\":" << result.max << ",\"count\":" << result.count;
+  if (result.count > 0) {
+    out << ",\"min\":" << result.min << ",\"mean\":" << result.sum / result.count << ",\"quantiles\":[";
+    for (size_t i = 0; i < quantiles.size(); ++i) {
+      // the sketch is only approximate, the extremes are known exactly
+      double value = sketch.quantile(quantiles[i]);
+      value = std::min<double>(std::max<double>(value, result.min), result.max);
+      out << (i ? "," : "") << value;
+    }
+    out << "]";
+  } else {
+    out << ",\"min\":null,\"mean\":null,\"quantiles\":null";
+  }
+  out << "}";
+  return out.str();
+}
+
+// Results of whole raster queries, kept in a sidecar file next to the
+// raster. Each line holds the version of the raster the result was computed
+// for (its size, inode and modification time to the nanosecond), the kind of
+// query and the result, so a changed raster misses and its stale results are
+// dropped on the next store. Rasters modified within the current second are
+// not stored, since a rewrite in the same second may keep the same version on
+// file systems with coarser timestamps. Failing to read or write the sidecar
+// (eg. a read-only directory) just disables the cache.
+class ResultCache {
+public:
+  explicit ResultCache(const std::string& filename) : cachePath(filename + ".aggregate-cache"), valid(false) {
+    struct stat info;
+    if (::stat(filename.c_str(), &info) != 0) return;
+    std::ostringstream id;
+    id << info.st_size << " " << info.st_ino << " " << info.st_mtim.tv_sec << " " << info.st_mtim.tv_nsec;
+    version = id.str();
+    valid = true;
+    storable = info.st_mtim.tv_sec < std::time(NULL);
+
+    boost::filesystem::ifstream in(cachePath);
+    std::string line;
+    while (std::getline(in, line)) {
+      // the version fields, then the query and the result
+      std::string::size_type end = 0;
+      for (int i = 0; i < 4 && end != std::string::npos; ++i) {
+        end = line.find(' ', end ? end + 1 : 0);
+      }
+      if (end == std::string::npos || line.compare(0, end, version) != 0) continue;
+
+      std::istringstream fields(line.substr(end + 1));
+      std::string query, result;
+      if (std::getline(fields, query, '\t') && std::getline(fields, result)) {
+        entries.push_back(std::make_pair(query, result));
+      }
+    }
+  }
+
+  bool lookup(const std::string& query, std::string& result) const {
+    for (auto& entry : entries) {
+      if (entry.first == query) {
+        result = entry.second;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Rewrites the sidecar with the current entries; it is written to a
+  // temporary file first so that concurrent readers never see it partially.
+  void store(const std::string& query, const std::string& result) {
+    if (!valid || !storable) return;
+    entries.push_back(std::make_pair(query, result));
+
+    boost::filesystem::path tmpPath = cachePath;
+    tmpPath += boost::filesystem::unique_path(".%%%%-%%%%");
+    {
+      boost::filesystem::ofstream out(tmpPath);
+      for (auto& entry : entries) {
+        out << version << " " << entry.first << "\t" << entry.second << "\n";
+      }
+      if (!out) return;
+    }
+    boost::system::error_code error;
+    boost::filesystem::rename(tmpPath, cachePath, error);
+    if (error) {
+      boost::filesystem::remove(tmpPath, error);
+    }
+  }
+
+private:
+  boost::filesystem::path cachePath;
+  bool valid;
+  bool storable;
+  std::string version;
+  std::vector<std::pair<std::string, std::string>> entries;
+};
+
+int main(int argc, char *argv[]) {
+  namespace po = boost::program_options;
+
+  po::options_description desc("Options");
+  desc.add_options()
+    ("help,h", "Print help message")
+    ("threads,t", po::value<unsigned>(), "number of threads reading blocks (defaults to hardware threads)")
+    ("polygon,p", po::value<std::vector<std::string>>(), "aggregate only under this polygon, given as WKT or GeoJSON geometry (or a file with either) in the raster coordinates; can be repeated")
+    ("stats,s", "print a JSON line of statistics (sum, max, min, count, mean and quantiles) for each raster or polygon")
+    ("quantiles,q", po::value<std::vector<std::string>>(), "quantiles to estimate with --stats, comma separated (default 0,0.25,0.5,0.75,1)")
+    ("no-cache", "do not read nor store whole raster results in the .aggregate-cache file next to each raster")
+    ("raster", po::value<std::vector<std::string>>(), "population raster files");
+  po::positional_options_description positional;
+  positional.add("raster", -1);
+
+  po::variables_map vm;
+  try {
+    po::store(po::command_line_parser(argc, argv).options(desc).positional(positional).run(), vm);
+    po::notify(vm);
+  } catch (po::error& e) {
+    std::cout << "ERROR: " << e.what() << std::endl;
+    exit(1);
+  }
+
+  if (vm.count("help") || !vm.count("raster")) {
+    std::cout << "Usage: aggregate-population [options] RASTERFILE..." << std::endl << std::endl
+              << "Prints the sum and maximum of the raster values, under each polygon if given," << std::endl
+              << "for every raster in turn." << std::endl << std::endl
+              << desc;
+    exit(vm.count("help") ? 0 : 1);
+  }
+
+  unsigned threads = std::thread::hardware_concurrency();
+  if (vm.count("threads")) {
+    threads = vm["threads"].as<unsigned>();
+  }
+
+  GDALAllRegister();
+
+  std::vector<double> quantiles = { 0, 0.25, 0.5, 0.75, 1 };
+  if (vm.count("quantiles")) {
+    quantiles.clear();
+    for (const std::string& arg : vm["quantiles"].as<std::vector<std::string>>()) {
+      std::stringstream values(arg);
+      std::string value;
+      while (std::getline(values, value, ',')) {
+        char* end;
+        double q = strtod(value.c_str(), &end);
+        if (value.empty() || *end || q < 0 || q > 1) {
+          std::cout << "ERROR: invalid quantile '" << value << "'" << std::endl;
+          exit(1);
         }
+        quantiles.push_back(q);
       }
     }
   }
+  bool stats = vm.count("stats");
+
+  std::vector<std::shared_ptr<OGRGeometry>> polygons;
+  if (vm.count("polygon")) {
+    for (const std::string& polygon : vm["polygon"].as<std::vector<std::string>>()) {
+      polygons.push_back(parsePolygon(polygon));
+    }
+  }
 
-  std::cout << ((long)sum) << " " << ((long)ceil(max)) << std::endl;
+  // without polygons the whole raster is aggregated, otherwise one line is
+  // printed for each polygon in the order given
+  // whole raster results are cached unless asked not to
+  bool useCache = polygons.empty() && !vm.count("no-cache");
+  std::string query = "sum";
+  if (stats) {
+    std::ostringstream quantilesQuery;
+    quantilesQuery << std::setprecision(10) << "stats";
+    for (size_t i = 0; i < quantiles.size(); ++i) {
+      quantilesQuery << (i ? "," : " ") << quantiles[i];
+    }
+    query = quantilesQuery.str();
+  }
+
+  for (const std::string& filename : vm["raster"].as<std::vector<std::string>>()) {
+    std::unique_ptr<ResultCache> cache;
+    std::string cached;
+    if (useCache) {
+      cache.reset(new ResultCache(filename));
+      if (cache->lookup(query, cached)) {
+        std::cout << (stats ? "{\"raster\":" + jsonString(filename) + cached : cached) << std::endl;
+        continue;
+      }
+    }
+
+    std::vector<Zone> zones;
+    GDALDataset* dataset = openRaster(filename);
+    if (!polygons.empty()) {
+      for (auto& polygon : polygons) {
+        zones.push_back(polygonZone(dataset, polygon));
+      }
+    } else {
+      zones.push_back(rasterZone(dataset));
+    }
+    closeRaster(dataset);
+
+    std::vector<QuantileSketch> sketches;
+    std::vector<Aggregate> results = aggregateZones(filename, zones, threads, stats ? &sketches : NULL);
+    for (size_t i = 0; i < results.size(); ++i) {
+      std::string result;
+      if (stats) {
+        result = statisticsJson(results[i], sketches[i], quantiles);
+        std::cout << "{\"raster\":" << jsonString(filename);
+        if (!polygons.empty()) {
+          std::cout << ",\"polygon\":" << i;
+        }
+        std::cout << result << std::endl;
+      } else {
+        result = std::to_string((long)results[i].sum) + " " + std::to_string((long)ceil(results[i].max));
+        std::cout << result << std::endl;
+      }
+      if (cache) {
+        cache->store(query, result);
+      }
+    }
+  }
 }
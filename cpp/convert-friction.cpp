@@ -0,0 +1,81 @@
+#include "boost/program_options.hpp"
+#include "boost/filesystem.hpp"
+
+#include "gdal_priv.h"
+
+#include <iostream>
+#include <string>
+#include <stdexcept>
+
+#include "walking-coverage.h"
+
+using namespace std;
+
+// ===== Main entry point
+
+int main(int argc, char *argv[])
+{
+  namespace po = boost::program_options;
+
+  const string appName = boost::filesystem::basename(argv[0]);
+
+  po::options_description desc("Options");
+  desc.add_options()
+    ("help,h", "Print help message")
+    ("input-friction-raster,i", po::value<string>(), "input friction raster file")
+    ("output,o", po::value<string>(), "output native friction file (defaults to the input with the .friction extension)");
+
+  po::positional_options_description positional;
+  positional.add("input-friction-raster", 1).add("output", 1);
+
+  po::variables_map vm;
+  try {
+    po::store(po::command_line_parser(argc, argv).options(desc).positional(positional).run(), vm);
+    po::notify(vm);
+  } catch (po::error& e) {
+    cerr << "ERROR: " << e.what() << endl;
+    cerr << "Run with --help for available options" << endl;
+    return 1;
+  }
+
+  if (vm.count("help")) {
+    cout << "Usage: " << appName << " [options] input [output]" << endl << endl
+         << "Converts the first band of a friction raster into the uncompressed and "
+         << "tiled native format that walking-coverage maps in memory. When given "
+         << "a raster, walking-coverage uses the native file next to it with the "
+         << ".friction extension, if it is not older than the raster." << endl << endl
+         << desc << endl;
+    return 0;
+  }
+
+  if (!vm.count("input-friction-raster")) {
+    cerr << "ERROR: missing input friction raster" << endl;
+    cerr << "Run with --help for available options" << endl;
+    return 1;
+  }
+
+  const string input = vm["input-friction-raster"].as<string>();
+  string output = boost::filesystem::path(input).replace_extension(NATIVE_FRICTION_EXTENSION).string();
+  if (vm.count("output")) {
+    output = vm["output"].as<string>();
+  }
+
+  GDALAllRegister();
+
+  try {
+    GDALDataset *pDataset = (GDALDataset *) GDALOpen(input.c_str(), GA_ReadOnly);
+    if (pDataset == NULL) {
+      throw runtime_error("cannot open raster '" + input + "'");
+    }
+    raster_t raster(pDataset);
+    if (!raster.is_north_up()) {
+      throw runtime_error("raster must be normalized 'north-up'");
+    }
+    write_native_friction(pDataset, output);
+  } catch (exception& e) {
+    cerr << "ERROR: " << e.what() << endl;
+    return 2;
+  }
+
+  return 0;
+}
@@ -0,0 +1,479 @@
+#include "boost/program_options.hpp"
+#include "boost/filesystem.hpp"
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <memory>
+#include <random>
+#include <chrono>
+#include <cmath>
+
+#include "walking-coverage.h"
+
+using namespace std;
+
+// ===== Synthetic data
+
+namespace {
+  const float BENCH_NODATA = -9999;
+  const float BENCH_PIXEL_METERS = 100;
+  const double BENCH_PIXEL_DEGREES = 0.001; // about 111 m near the equator
+  const unsigned BENCH_SEED = 42;
+
+  const float WALKING_FRICTION = 0.012f; // 5 km/h
+  const float RIVER_FRICTION = 1.0f;     // 100 minutes to cross a pixel
+  const int RIVER_SPACING = 256;         // pixels between rivers
+  const int BRIDGE_SPACING = 200;        // pixels between bridges over a river
+  const int LAND_BLOCK = 16;             // side of the land patches with mostly nodata
+}
+
+// Friction between 0.005 and 0.05 min/m (12 to 1.2 km/h) with about 2% of
+// nodata pixels, always generated with the same seed so that runs compare.
+static unique_ptr<float[]>
+synthetic_friction(int width, int height)
+{
+  mt19937 rng(BENCH_SEED);
+  uniform_real_distribution<float> friction(0.005f, 0.05f);
+  uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+  const size_t size = (size_t) width * height;
+  unique_ptr<float[]> data(new float[size]);
+  for (size_t i = 0; i < size; ++i) {
+    data[i] = unit(rng) < 0.02f ? BENCH_NODATA : friction(rng);
+  }
+  return data;
+}
+
+// Walking friction everywhere.
+static unique_ptr<float[]>
+uniform_friction(int width, int height)
+{
+  const size_t size = (size_t) width * height;
+  unique_ptr<float[]> data(new float[size]);
+  fill(data.get(), data.get() + size, WALKING_FRICTION);
+  return data;
+}
+
+// Noisy friction crossed by meandering rivers, both horizontal and vertical,
+// three pixels wide and only passable on bridges. The search has to find its
+// way around them, which makes for long and ragged contours.
+static unique_ptr<float[]>
+river_friction(int width, int height)
+{
+  unique_ptr<float[]> data = synthetic_friction(width, height);
+  auto meander = [](int along, int offset) {
+    return offset + (int) (RIVER_SPACING / 8 * sin(along / 40.0 + offset));
+  };
+
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      const bool bridgeX = x % BRIDGE_SPACING < 2;
+      const bool bridgeY = y % BRIDGE_SPACING < 2;
+      const int nearestY = (y / RIVER_SPACING) * RIVER_SPACING + RIVER_SPACING / 2;
+      const int nearestX = (x / RIVER_SPACING) * RIVER_SPACING + RIVER_SPACING / 2;
+      if ((!bridgeX && abs(y - meander(x, nearestY)) <= 1)
+          || (!bridgeY && abs(x - meander(y, nearestX)) <= 1)) {
+        data[x + (size_t) width * y] = RIVER_FRICTION;
+      }
+    }
+  }
+  return data;
+}
+
+// Mostly nodata, with a quarter of square land patches of noisy friction
+// scattered at random; the patch at the centre (the search origin) is
+// always land.
+static unique_ptr<float[]>
+sparse_land_friction(int width, int height)
+{
+  unique_ptr<float[]> data = synthetic_friction(width, height);
+  mt19937 rng(BENCH_SEED + 1);
+  uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+  const int blocksX = (width + LAND_BLOCK - 1) / LAND_BLOCK;
+  const int blocksY = (height + LAND_BLOCK - 1) / LAND_BLOCK;
+  vector<bool> land(blocksX * blocksY);
+  for (size_t i = 0; i < land.size(); ++i) {
+    land[i] = unit(rng) < 0.25f;
+  }
+  land[width / 2 / LAND_BLOCK + blocksX * (height / 2 / LAND_BLOCK)] = true;
+
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      if (!land[x / LAND_BLOCK + blocksX * (y / LAND_BLOCK)]) {
+        data[x + (size_t) width * y] = BENCH_NODATA;
+      }
+    }
+  }
+  return data;
+}
+
+typedef unique_ptr<float[]> (*friction_generator_t)(int width, int height);
+
+struct scenario_t {
+  const char *_name;
+  friction_generator_t _generate;
+};
+
+const scenario_t SCENARIOS[] = {
+  { "uniform", uniform_friction },
+  { "noisy", synthetic_friction },
+  { "rivers", river_friction },
+  { "nodata", sparse_land_friction }
+};
+
+// Friction raster of the scenario as an in-memory GDAL dataset with square
+// pixels of BENCH_PIXEL_DEGREES on the equator, so that it is read back
+// through GDAL exactly like a friction file.
+static unique_ptr<raster_t>
+synthetic_raster(const scenario_t& scenario, int width, int height)
+{
+  GDALDriver *driver = GetGDALDriverManager()->GetDriverByName("MEM");
+  if (driver == NULL) {
+    throw runtime_error("GDAL MEM driver is not available");
+  }
+  GDALDataset *dataset = driver->Create("", width, height, 1, GDT_Float32, NULL);
+  if (dataset == NULL) {
+    throw runtime_error("cannot create in-memory raster");
+  }
+  double geoTransform[6] = { 0, BENCH_PIXEL_DEGREES, 0, height * BENCH_PIXEL_DEGREES / 2, 0, -BENCH_PIXEL_DEGREES };
+  dataset->SetGeoTransform(geoTransform);
+  unique_ptr<raster_t> raster(new raster_t(dataset));
+
+  unique_ptr<float[]> data = scenario._generate(width, height);
+  GDALRasterBand *band = dataset->GetRasterBand(1);
+  band->SetNoDataValue(BENCH_NODATA);
+  if (band->RasterIO(GF_Write, 0, 0, width, height, data.get(), width, height, GDT_Float32, 0, 0) != CE_None) {
+    throw runtime_error("cannot write in-memory raster");
+  }
+  return raster;
+}
+
+// ===== Measurement
+
+// best wall time in seconds of `repeat` runs of the task
+static double
+best_time(int repeat, const function<void()>& task)
+{
+  double best = numeric_limits<double>::infinity();
+  for (int i = 0; i < repeat; ++i) {
+    auto start = chrono::steady_clock::now();
+    task();
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    best = min(best, elapsed.count());
+  }
+  return best;
+}
+
+// ===== Benchmarks
+
+// Runs the search alone on row-major friction data already converted to
+// effective friction in the given layout; the cost layer is left in the
+// same layout.
+template<typename layout_t>
+static double
+time_search(const layout_t& layout, const float *friction, float maxTime, int repeat)
+{
+  const friction_params_t params =
+    layer_friction_params(BENCH_NODATA, maxTime, 0.0f, BENCH_PIXEL_METERS, BENCH_PIXEL_METERS);
+  unique_ptr<float[]> effective(new float[layout.size()]);
+  build_effective_friction(layout, friction_data_t::row_major(friction, layout._width), { params }, { effective.get() }, 1);
+  const float *pEffective = effective.get();
+
+  return best_time(repeat, [&]() {
+    dense_grid_t<float> cost(layout.size(), 10 * maxTime);
+    run_dijkstra_with_layout(layout, cost, pEffective,
+                             BENCH_PIXEL_METERS, BENCH_PIXEL_METERS,
+                             layout._width / 2, layout._height / 2, maxTime, QUEUE_DARY);
+  });
+}
+
+// Runs the whole search, from row-major friction to row-major costs, with
+// the given search state on the tiled layout.
+static double
+time_tiled_search(int width, int height, const float *friction, float maxTime,
+                  search_state_kind_t state, int repeat)
+{
+  return best_time(repeat, [&]() {
+    run_dijkstra_on_friction_layers(friction, width, height, BENCH_NODATA,
+                                    BENCH_PIXEL_METERS, BENCH_PIXEL_METERS,
+                                    width / 2, height / 2, { maxTime }, { 0.0f },
+                                    QUEUE_DARY, LAYOUT_TILED, state);
+  });
+}
+
+// Searches from the centre of rasters of increasing width but the same
+// height. Once the raster is wider than the area reached the search visits
+// about the same number of pixels, so any slowdown comes from the longer
+// row stride. The time to convert the friction data into the tiled layout
+// and the costs back is reported separately. The last two columns time the
+// whole search on the tiled layout, from row-major friction to row-major
+// costs, with dense and sparse search state.
+static void
+bench_layouts(const vector<int>& widths, int height, float maxTime, int repeat, ostream& out)
+{
+  out << left << setw(8) << "width" << setw(8) << "height" << setw(10) << "reached"
+      << setw(12) << "row-major" << setw(12) << "tiled" << setw(12) << "conversion"
+      << setw(12) << "dense" << "sparse" << endl;
+
+  for (int width : widths) {
+    const size_t size = (size_t) width * height;
+    unique_ptr<float[]> friction = synthetic_friction(width, height);
+
+    search_result_t search =
+      run_dijkstra_on_friction_layers(friction.get(), width, height, BENCH_NODATA,
+                                      BENCH_PIXEL_METERS, BENCH_PIXEL_METERS,
+                                      width / 2, height / 2, { maxTime }, { 0.0f },
+                                      QUEUE_DARY, LAYOUT_ROW_MAJOR, STATE_DENSE);
+    const float *cost = search._costs[0].get();
+    const size_t reached = count_if(cost, cost + size, [maxTime](float c) { return c <= maxTime; });
+
+    const double rowMajorTime = time_search(row_major_layout_t(width, height), friction.get(), maxTime, repeat);
+    const double tiledTime = time_search(tiled_layout_t(width, height), friction.get(), maxTime, repeat);
+
+    tiled_layout_t tiled(width, height);
+    unique_ptr<float[]> tiledFriction(new float[tiled.size()]);
+    unique_ptr<float[]> rowMajorCost(new float[size]);
+    const double conversionTime = best_time(repeat, [&]() {
+      tiled.from_row_major(friction.get(), tiledFriction.get(), BENCH_NODATA);
+      tiled.to_row_major(tiledFriction.get(), rowMajorCost.get());
+    });
+
+    const double denseTime = time_tiled_search(width, height, friction.get(), maxTime, STATE_DENSE, repeat);
+    const double sparseTime = time_tiled_search(width, height, friction.get(), maxTime, STATE_SPARSE, repeat);
+
+    out << left << setw(8) << width << setw(8) << height << setw(10) << reached << fixed << setprecision(4)
+        << setw(12) << rowMajorTime << setw(12) << tiledTime << setw(12) << conversionTime
+        << setw(12) << denseTime << sparseTime << endl;
+  }
+}
+
+// Measures every kernel of a coverage computation on its own, from the
+// centre of a square raster of every size, for every budget. Each kernel
+// runs on the output of the previous one: the search on the friction read
+// from the raster, CONREC on the costs, the contour builder on the segments
+// collected from CONREC, and simplification on the polygons built. The
+// parallel search runs on the same friction with every thread count, and
+// must find the same costs as the sequential one; fast sweeping solves a
+// different discretization, so only the pixels it reaches are reported.
+// Cost layer merging runs on the search costs and a copy scaled to another
+// budget. Every measurement is written as a line of JSON.
+static void
+bench_kernels(const vector<const scenario_t *>& scenarios, const vector<int>& sizes,
+              const vector<float>& maxTimes, const vector<unsigned>& threadCounts, int repeat, ostream& out)
+{
+  auto report = [&](const scenario_t& scenario, int size, float maxTime, const char *kernel,
+                    double seconds, const char *countName, size_t count) {
+    out << "{\"scenario\":\"" << scenario._name << "\",\"width\":" << size << ",\"height\":" << size
+        << ",\"max_time\":" << maxTime << ",\"kernel\":\"" << kernel << "\""
+        << ",\"seconds\":" << scientific << setprecision(4) << seconds << defaultfloat
+        << ",\"" << countName << "\":" << count << ",\"repeat\":" << repeat << "}" << endl;
+  };
+
+  for (const scenario_t *scenario : scenarios) {
+    for (int size : sizes) {
+      unique_ptr<raster_t> raster = synthetic_raster(*scenario, size, size);
+      float nodata;
+      unique_ptr<float[]> friction = load_friction_data(raster->dataset(), 1, raster->full_window(), &nodata);
+      const float pixelWidth = raster->pixel_width_meters();
+      const float pixelHeight = raster->pixel_height_meters();
+
+      for (float maxTime : maxTimes) {
+        // search
+        search_result_t search;
+        const double searchTime = best_time(repeat, [&]() {
+          search = run_dijkstra_on_friction_layers(friction.get(), size, size, nodata, pixelWidth, pixelHeight,
+                                                   size / 2, size / 2, { maxTime }, { 0.0f });
+        });
+        const raster_window_t& window = search._window;
+        const float *cost = search._costs[0].get();
+        const size_t pixels = (size_t) window._width * window._height;
+        const size_t reached = count_if(cost, cost + pixels, [maxTime](float c) { return c <= maxTime; });
+        report(*scenario, size, maxTime, "search", searchTime, "reached", reached);
+
+        for (unsigned threads : threadCounts) {
+          search_result_t parallel;
+          const double parallelTime = best_time(repeat, [&]() {
+            parallel = run_parallel_search(friction_data_t::row_major(friction.get(), size), size, size, nodata,
+                                           pixelWidth, pixelHeight, size / 2, size / 2, { maxTime }, { 0.0f },
+                                           threads);
+          });
+          const raster_window_t& parallelWindow = parallel._window;
+          if (!window.contains(parallelWindow) || !parallelWindow.contains(window)
+              || !equal(cost, cost + pixels, parallel._costs[0].get())) {
+            throw runtime_error("parallel search costs differ from the sequential search");
+          }
+          report(*scenario, size, maxTime, "parallel_search", parallelTime, "threads", threads);
+        }
+
+        search_result_t sweep;
+        const double sweepTime = best_time(repeat, [&]() {
+          sweep = run_sweep_search(friction_data_t::row_major(friction.get(), size), size, size, nodata,
+                                   pixelWidth, pixelHeight, size / 2, size / 2, { maxTime }, { 0.0f });
+        });
+        const float *sweepCost = sweep._costs[0].get();
+        const size_t sweepReached = count_if(sweepCost, sweepCost + (size_t) size * size,
+                                             [maxTime](float c) { return c <= maxTime; });
+        report(*scenario, size, maxTime, "sweep_search", sweepTime, "reached", sweepReached);
+
+        // contouring of a few levels up to the budget
+        vector<float> levels = { maxTime / 4, maxTime / 2, maxTime };
+        vector<const float *> rows(window._height);
+        vector<double> latitudes(window._height), longitudes(window._width);
+        for (int y = 0; y < window._height; ++y) {
+          rows[y] = cost + (size_t) window._width * y;
+          latitudes[y] = -(window._yOff + y + 0.5) * BENCH_PIXEL_DEGREES;
+        }
+        for (int x = 0; x < window._width; ++x) {
+          longitudes[x] = (window._xOff + x + 0.5) * BENCH_PIXEL_DEGREES;
+        }
+        typedef pair<coords_t, coords_t> segment_t;
+        vector<vector<segment_t>> segments(levels.size());
+        const double conrecTime = best_time(repeat, [&]() {
+          for (auto& levelSegments : segments) levelSegments.clear();
+          conrec(rows.data(), 0, window._height - 1, 0, window._width - 1,
+                 latitudes.data(), longitudes.data(), levels.size(), levels.data(),
+                 [&](double x1, double y1, double x2, double y2, float z) {
+                   const size_t k = find(levels.begin(), levels.end(), z) - levels.begin();
+                   segments[k].push_back(segment_t(make_coords(y1, x1), make_coords(y2, x2)));
+                 });
+        });
+        size_t segmentCount = 0;
+        for (auto& levelSegments : segments) segmentCount += levelSegments.size();
+        report(*scenario, size, maxTime, "conrec", conrecTime, "segments", segmentCount);
+
+        vector<unique_ptr<OGRGeometry>> polygons;
+        const double builderTime = best_time(repeat, [&]() {
+          polygons.clear();
+          for (auto& levelSegments : segments) {
+            contour_builder_t builder;
+            for (auto& segment : levelSegments) {
+              builder.add_segment(segment.first, segment.second);
+            }
+            polygons.emplace_back(builder.build());
+          }
+        });
+        report(*scenario, size, maxTime, "contour_builder", builderTime, "segments", segmentCount);
+
+        size_t points = 0;
+        const double simplifyTime = best_time(repeat, [&]() {
+          points = 0;
+          for (auto& polygon : polygons) {
+            unique_ptr<OGRGeometry> simplified(polygon->SimplifyPreserveTopology(BENCH_PIXEL_DEGREES / 2));
+            OGRLinearRing *ring = simplified ? ((OGRPolygon *) simplified.get())->getExteriorRing() : NULL;
+            if (ring != NULL) {
+              points += ring->getNumPoints();
+            }
+          }
+        });
+        report(*scenario, size, maxTime, "simplify", simplifyTime, "points", points);
+
+        // merge with a slower layer, as for a second transport layer
+        unique_ptr<float[]> layer(new float[pixels]);
+        unique_ptr<float[]> base(new float[pixels]);
+        for (size_t i = 0; i < pixels; ++i) {
+          layer[i] = cost[i] * 1.5f;
+        }
+        const double mergeTime = best_time(repeat, [&]() {
+          copy(cost, cost + pixels, base.get());
+          merge_cost_layers(base.get(), { layer.get() }, window._width, window._height,
+                            maxTime, { maxTime * 2 }, 1);
+        });
+        report(*scenario, size, maxTime, "merge_cost_layers", mergeTime, "pixels", pixels);
+      }
+    }
+  }
+}
+
+// ===== Main entry point
+
+int main(int argc, char *argv[])
+{
+  namespace po = boost::program_options;
+
+  const string appName = boost::filesystem::basename(argv[0]);
+
+  po::options_description desc("Options");
+  desc.add_options()
+    ("help,h", "Print help message")
+    ("scenarios", po::value<vector<string>>()->multitoken(), "synthetic rasters to run the kernels on: uniform, noisy, rivers, nodata (default all)")
+    ("sizes,s", po::value<vector<int>>()->multitoken(), "side of the square rasters to run the kernels on (default 512 2048 4096)")
+    ("threads,t", po::value<vector<unsigned>>()->multitoken(), "thread counts of the parallel search (default 1 and the hardware threads)")
+    ("max-time,m", po::value<vector<float>>()->multitoken(), "search budgets in minutes (default 60 240 600, only the last one for --layouts)")
+    ("repeat,r", po::value<int>()->default_value(3), "runs per measurement, the best one is reported")
+    ("layouts", "Compare the pixel layouts and search states instead, as a table")
+    ("widths,w", po::value<vector<int>>()->multitoken(), "raster widths for --layouts (default 512 2048 8192 32768)")
+    ("height", po::value<int>()->default_value(1024), "raster height for --layouts");
+
+  po::variables_map vm;
+  try {
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+  } catch (po::error& e) {
+    cerr << "ERROR: " << e.what() << endl;
+    cerr << "Run with --help for available options" << endl;
+    return 1;
+  }
+
+  if (vm.count("help")) {
+    cout << "Usage: " << appName << " [options]" << endl << endl
+         << "Benchmarks the coverage kernels on synthetic friction rasters, writing "
+         << "one JSON object per line and measurement." << endl << endl
+         << desc << endl;
+    return 0;
+  }
+
+  const int repeat = max(1, vm["repeat"].as<int>());
+  vector<float> maxTimes = { 60, 240, 600 };
+  if (vm.count("max-time")) {
+    maxTimes = vm["max-time"].as<vector<float>>();
+  }
+
+  if (vm.count("layouts")) {
+    vector<int> widths = { 512, 2048, 8192, 32768 };
+    if (vm.count("widths")) {
+      widths = vm["widths"].as<vector<int>>();
+    }
+    bench_layouts(widths, vm["height"].as<int>(), maxTimes.back(), repeat, cout);
+    return 0;
+  }
+
+  vector<const scenario_t *> scenarios;
+  if (vm.count("scenarios")) {
+    for (auto& name : vm["scenarios"].as<vector<string>>()) {
+      auto it = find_if(begin(SCENARIOS), end(SCENARIOS), [&](const scenario_t& s) { return name == s._name; });
+      if (it == end(SCENARIOS)) {
+        cerr << "ERROR: unknown scenario '" << name << "'" << endl;
+        return 1;
+      }
+      scenarios.push_back(&*it);
+    }
+  } else {
+    for (auto& scenario : SCENARIOS) {
+      scenarios.push_back(&scenario);
+    }
+  }
+  vector<int> sizes = { 512, 2048, 4096 };
+  if (vm.count("sizes")) {
+    sizes = vm["sizes"].as<vector<int>>();
+  }
+
+  vector<unsigned> threadCounts = { 1 };
+  if (thread_count(0) > 1) {
+    threadCounts.push_back(thread_count(0));
+  }
+  if (vm.count("threads")) {
+    threadCounts = vm["threads"].as<vector<unsigned>>();
+  }
+
+  GDALAllRegister();
+  try {
+    bench_kernels(scenarios, sizes, maxTimes, threadCounts, repeat, cout);
+  } catch (exception& e) {
+    cerr << "ERROR: " << e.what() << endl;
+    return 2;
+  }
+  return 0;
+}
@@ -1,8 +1,9 @@
 #include "boost/program_options.hpp"
 #include "boost/filesystem.hpp"
 #include "boost/algorithm/string.hpp"
-#include "boost/heap/binomial_heap.hpp"
 #include "boost/timer/timer.hpp"
+#include "boost/property_tree/ptree.hpp"
+#include "boost/property_tree/json_parser.hpp"
 
 #include "gdal_priv.h"
 #include "cpl_conv.h"
@@ -12,134 +13,47 @@
 #include <iostream>
 #include <string>
 #include <sstream>
+#include <iomanip>
 #include <stdexcept>
 #include <list>
 #include <vector>
 #include <functional>
 #include <limits>
+#include <cstdint>
+#include <memory>
+#include <ctime>
+#include <fstream>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <atomic>
 
-using namespace std;
-
-// ====== Generic utilities
-
-template<typename T> inline bool
-between(const T& value, const T& x1, const T& x2)
-{
-  if (x1 > x2) {
-    return value >= x2 && value <= x1;
-  } else {
-    return value >= x1 && value <= x2;
-  }
-}
-
-
-
-// ===== Coordinates
-
-typedef pair<double,double> coords_t;
-typedef list<coords_t> coords_list_t;
-
-inline coords_t
-make_coords(double lng, double lat)
-{
-  return make_pair(lng, lat);
-}
-
-typedef pair<int,int> pixel_coords_t;
-
-inline pixel_coords_t
-make_pixel_coords(int x, int y)
-{
-  return make_pair(x, y);
-}
-
-template<typename T>
-ostream& operator<<(ostream& os, const pair<T,T>& p) {
-  os << p.first << "," << p.second;
-  return os;
-}
-
-
-// ===== Raster adapter
-
-class raster_t {
-  GDALDataset *_dataset;
-  double _geoTransform[6];
-
-public:
-  raster_t(GDALDataset *poDataset) : _dataset(poDataset) {
-    if (poDataset == NULL) {
-      throw invalid_argument("dataset cannot be NULL");
-    }
-    if (poDataset->GetGeoTransform(_geoTransform) != CE_None) {
-      throw invalid_argument("cannot get geotransform for raster");
-    }
-  }
-  virtual ~raster_t() {
-    GDALClose(_dataset);
-  }
-
-  bool is_north_up() const {
-    return _geoTransform[2] == 0 && _geoTransform[4] == 0
-      && _geoTransform[1] > 0 && _geoTransform[5] < 0;
-  }
-  coords_t top_left_coords() const {
-    return make_coords(_geoTransform[0], _geoTransform[3]);
-  }
-  coords_t bottom_right_coords() const {
-    return make_coords(_geoTransform[0] + _geoTransform[1] * _dataset->GetRasterXSize(),
-                       _geoTransform[3] + _geoTransform[5] * _dataset->GetRasterYSize());
-  }
-  int x_size() const { return _dataset->GetRasterXSize(); }
-  int y_size() const { return _dataset->GetRasterYSize(); }
-  int band_count() const { return _dataset->GetRasterCount(); }
-  double pixel_width() const { return _geoTransform[1]; }
-  double pixel_height() const { return -_geoTransform[5]; }
-  GDALDataset *dataset() const { return _dataset; }
-  GDALDriver *driver() const { return _dataset->GetDriver(); }
-  float pixel_width_meters() const {
-    float lngDegDistInMEquator = 111111.0f;
-    float centerLat = (top_left_coords().second + bottom_right_coords().second) / 2;
-    return lngDegDistInMEquator * cos(M_PI * centerLat / 180.0f) * pixel_width();
-  }
-  float pixel_height_meters() const {
-    float latDegDistInM = 111111.0f;
-    return latDegDistInM * pixel_height();
-  }
-
-  const bool contains(const coords_t& point) const {
-    const coords_t tl(top_left_coords());
-    const coords_t br(bottom_right_coords());
-    return between(point.first, tl.first, br.first)
-      && between(point.second, tl.second, br.second);
-  }
-
-  pixel_coords_t pixel_coords(const coords_t& lnglat) const {
-    const coords_t tl(top_left_coords());
-
-    return make_pixel_coords((lnglat.first - tl.first) / pixel_width(),
-                             (lnglat.second - tl.second) / -pixel_height());
-  }
-};
+#include <sys/stat.h>
 
+#include "walking-coverage.h"
 
+using namespace std;
 
 // ===== Utility functions
 
 static void
 show_raster_info(const raster_t &raster, std::ostream& out)
 {
-  out << "Driver: " << raster.driver()->GetDescription()
-      << "/" << raster.driver()->GetMetadataItem(GDAL_DMD_LONGNAME)
-      << endl;
+  if (raster.driver() != NULL) {
+    out << "Driver: " << raster.driver()->GetDescription()
+        << "/" << raster.driver()->GetMetadataItem(GDAL_DMD_LONGNAME)
+        << endl;
+  } else {
+    out << "Driver: native friction file" << endl;
+  }
 
   out << "Raster size: " << raster.x_size()
       << "x" << raster.y_size()
       << "x" << raster.band_count()
       << endl;
 
-  if (raster.dataset()->GetProjectionRef() != NULL) {
-    out << "Projection: " << raster.dataset()->GetProjectionRef() << endl;
+  if (!raster.projection().empty()) {
+    out << "Projection: " << raster.projection() << endl;
   } else {
     out << "No projection data" << endl;
   }
@@ -184,19 +98,135 @@ parse_coordinates(const string& s)
 namespace {
   const int DEFAULT_TIME_COST = 180;       // 180 minutes = 3 hours
   const float DEFAULT_FRICTION = 0.01;     // 0.01 min/m = 6 km/h (ie. walking speed)
+  const size_t DEFAULT_CACHE_SIZE = 4;     // decoded friction rasters kept when serving
+  const float DEFAULT_PYRAMID_ERROR = 5;   // minutes any pyramid search cost can be off by
 }
 
 // ===== Command line parsing
 
+// parameters of a single coverage computation
+struct coverage_request_t {
+  coords_t      _origin;
+  vector<int>   _maxTimeCost;
+  vector<float> _minFriction;
+  vector<int>   _levels;          // isochrone times, defaults to the first max-time
+  string        _outputCostPath;
+  string        _populationPath;  // population covered instead of isochrones
+  search_engine_kind_t _engine = ENGINE_DIJKSTRA;
+  vector<coords_t> _origins;      // searched at once instead of _origin, for the nearest one
+  string        _outputLabelPath; // nearest of _origins of every pixel
+};
+
+enum output_format_t {
+  FORMAT_WKT,
+  FORMAT_GEOJSON
+};
+
+// origin of a batch run, identified in the output by its id
+struct labelled_origin_t {
+  string   _id;
+  coords_t _coords;
+};
+
 struct run_options_t {
   string   _rasterPath;
-  string   _outputCostPath;
-  coords_t _origin;
-  bool     _verbose;
-  vector<int> _maxTimeCost;
-  vector<float> _minFriction;
+  bool     _verbose = false;
+  bool     _serve = false;
+  bool     _stats = false;
+  size_t   _cacheSize = DEFAULT_CACHE_SIZE;
+  unsigned _threads = 0;  // 0 means as many as hardware threads
+  queue_kind_t _queueKind = QUEUE_DARY;
+  layout_kind_t _layoutKind = LAYOUT_TILED;
+  search_state_kind_t _stateKind = STATE_SPARSE;
+  int      _pyramidFactor = 0;  // below 2 runs the plain search
+  float    _pyramidError = DEFAULT_PYRAMID_ERROR;
+  contour_kind_t _contourKind = CONTOUR_CONREC;
+  output_format_t _format = FORMAT_WKT;
+  coverage_request_t _request;
+  string   _originsPath;
+  vector<labelled_origin_t> _origins;
+  bool     _nearest = false;  // all the origins in a single search instead of a batch
+  string   _costCacheDir;     // cost surfaces kept between runs, if not empty
+
+  bool batch() const { return !_nearest && (!_originsPath.empty() || _origins.size() > 1); }
 };
 
+// fills in the default transport layer and isochrone level, checks that
+// every layer has both a maximum time and a minimum friction, and sorts the
+// levels in increasing order
+static void
+check_request(coverage_request_t& request)
+{
+  if (!request._maxTimeCost.size()) {
+    request._maxTimeCost.push_back(DEFAULT_TIME_COST);
+  }
+  if (!request._minFriction.size()) {
+    request._minFriction.push_back(DEFAULT_FRICTION);
+  }
+
+  if (request._maxTimeCost.size() != request._minFriction.size()) {
+    throw runtime_error("min-friction and max-time should appear the same number of times");
+  }
+
+  if (!request._levels.size()) {
+    request._levels.push_back(request._maxTimeCost[0]);
+  }
+  sort(request._levels.begin(), request._levels.end());
+  request._levels.erase(unique(request._levels.begin(), request._levels.end()), request._levels.end());
+  if (request._levels.front() <= 0) {
+    throw runtime_error("isochrone levels must be positive");
+  }
+}
+
+// Isochrone level in whole minutes, as the levels are kept.
+static int
+level_minutes(double level)
+{
+  if (level != floor(level)) {
+    ostringstream message;
+    message << "isochrone levels must be whole minutes, not " << level;
+    throw runtime_error(message.str());
+  }
+  return (int) level;
+}
+
+// search engine by name, on the command line or in requests
+static search_engine_kind_t
+parse_engine(const string& name)
+{
+  if (name == "dijkstra") return ENGINE_DIJKSTRA;
+  if (name == "parallel") return ENGINE_PARALLEL;
+  if (name == "sweep") return ENGINE_SWEEP;
+  throw runtime_error("unknown engine '" + name + "'");
+}
+
+static const char *
+engine_name(search_engine_kind_t engine)
+{
+  switch (engine) {
+  case ENGINE_PARALLEL: return "parallel";
+  case ENGINE_SWEEP: return "sweep";
+  default: return "dijkstra";
+  }
+}
+
+// Maximum cost for the search on every transport layer. The merged cost
+// surface is measured in minutes of the first layer, which is searched up to
+// the largest level, and the other layers proportionally. The cost raster
+// is written up to the max-time, so it is searched at least that far.
+static vector<float>
+search_budgets(const coverage_request_t& request)
+{
+  const float first = request._outputCostPath.empty()
+    ? request._levels.back() : max(request._levels.back(), request._maxTimeCost[0]);
+  const float scale = first / request._maxTimeCost[0];
+  vector<float> budgets;
+  for (int maxTimeCost : request._maxTimeCost) {
+    budgets.push_back(budgets.empty() ? first : (scale == 1.0f ? maxTimeCost : maxTimeCost * scale));
+  }
+  return budgets;
+}
+
 static bool
 parse_command_line(int argc, char *argv[], run_options_t& options)
 {
@@ -208,11 +238,29 @@ parse_command_line(int argc, char *argv[], run_options_t& options)
   desc.add_options()
     ("help,h", "Print help message")
     ("verbose,v", "Print debugging information")
-    ("input-friction-raster,i", po::value<string>(), "input friction raster file")
+    ("stats", "Write a JSON object with the time of every phase and counters of the work done to stderr, for every coverage computed")
+    ("input-friction-raster,i", po::value<string>(), "input friction raster file, or native friction file (see convert-friction)")
     ("output-cost-raster,o", po::value<string>(), "output cost raster file")
-    ("origin,g", po::value<string>(), "coordinates of origin given in lng,lat format")
+    ("population-raster,p", po::value<string>(), "population raster; outputs the population covered at every level instead of the isochrones")
+    ("origin,g", po::value<vector<string>>(), "coordinates of origin given in lng,lat format; runs in batch if given more than once")
+    ("origins", po::value<string>(), "CSV (id,lng,lat) or GeoJSON file of points to run in batch")
+    ("nearest", "search from all the origins at once instead of running a batch: the costs are the times to the nearest origin, and the coverage is the union of theirs")
+    ("output-label-raster", po::value<string>(), "output raster with the nearest origin of every pixel (numbered from 1 in input order, 0 where none is reached); requires --nearest")
+    ("threads,t", po::value<unsigned>(), "number of threads for origins in batch runs, or transport layers otherwise (defaults to hardware threads)")
     ("max-time,m", po::value<vector<int>>(), "maximum time given in minutes")
-    ("min-friction,f", po::value<vector<float>>(), "minimum friction to consider in min/m");
+    ("min-friction,f", po::value<vector<float>>(), "minimum friction to consider in min/m")
+    ("queue", po::value<string>(), "priority queue used by the search: dary (default) or binomial")
+    ("layout", po::value<string>(), "pixel layout used by the search: tiled (default) or row-major")
+    ("search-state", po::value<string>(), "search state allocation: sparse (default, by tile as reached; needs the tiled layout) or dense")
+    ("engine", po::value<string>(), "search engine: dijkstra (default), parallel (spreads a single search over the threads, on the tiled layout and sparse state) or sweep (fast sweeping of the eikonal equation, with round isochrones)")
+    ("pyramid-factor", po::value<int>(), "search coarse blocks of this many pixels a side first, and refine only around the contours (eg. 4); off by default")
+    ("pyramid-error", po::value<float>(), "maximum error in minutes of the pyramid search costs (default 5); smaller refines more of the raster")
+    ("contour", po::value<string>(), "contouring algorithm: conrec (default) or marching-squares")
+    ("levels,l", po::value<vector<string>>()->multitoken(), "isochrone times in minutes (eg. 15,30,60), contoured from a single search up to the largest one; defaults to the first max-time")
+    ("format", po::value<string>(), "output format: wkt (default, one line per level) or geojson (a FeatureCollection)")
+    ("serve", "Serve JSON requests read line by line from stdin")
+    ("cache-size", po::value<size_t>(), "number of decoded friction and population rasters to keep when serving")
+    ("cost-cache", po::value<string>(), "directory to keep the cost surface searched from every origin pixel in, so that later runs from it with the same settings skip the search, or carry it on for higher levels");
 
   po::variables_map vm;
 
@@ -229,46 +277,222 @@ parse_command_line(int argc, char *argv[], run_options_t& options)
            << "computed using the friction raster, with maximum travel time using a "
            << "minimum value of friction" << endl << desc << endl
            << "Note: Multiple transport layers are supported by specifying a pair "
-           << "max-time and min-friction for every layer." << endl;
+           << "max-time and min-friction for every layer." << endl << endl
+           << "A native friction file next to the friction raster, with the same name and "
+           << "the .friction extension, is mapped in memory and searched in place "
+           << "instead of reading the raster, unless it is older." << endl << endl
+           << "With --serve, every line read from stdin is a JSON object such as" << endl
+           << "  {\"raster\": \"1.tif\", \"origin\": [lng, lat], \"max-time\": [180], \"min-friction\": [0.01], \"levels\": [60, 180]}" << endl
+           << "and the coverage (or a line starting with ERROR) is written to stdout "
+           << "for each one. Keys not given default to the command line options (the raster "
+           << "to input-friction-raster, and the levels to the request max-time when it has "
+           << "one), and the \"population-raster\", \"engine\" and \"output-cost-raster\" "
+           << "keys work as the options of the same name." << endl << endl
+           << "In batch runs the friction raster is loaded once and the coverage of "
+           << "every origin is written in input order, prefixed by the origin id and "
+           << "a tab. With --nearest, the origins (from --origin and --origins, in that "
+           << "order) are searched instead as a single one that starts from all of them." << endl;
       return true;
     }
 
-    if (!vm.count("input-friction-raster")) {
+    options._serve = vm.count("serve") > 0;
+    if (vm.count("cache-size")) {
+      options._cacheSize = vm["cache-size"].as<size_t>();
+      if (options._cacheSize == 0) {
+        cerr << "ERROR: cache size must be at least 1" << endl;
+        cerr << "Run with --help for available options" << endl;
+        return false;
+      }
+    }
+
+    if (!vm.count("input-friction-raster") && !options._serve) {
       cerr << "ERROR: missing input friction raster option" << endl;
       cerr << "Run with --help for available options" << endl;
       return false;
     }
 
-    if (!vm.count("origin")) {
+    if (!vm.count("origin") && !vm.count("origins") && !options._serve) {
       cerr << "ERROR: missing origin coordinates" << endl;
       cerr << "Run with --help for available options" << endl;
       return false;
     }
 
-    options._rasterPath = vm["input-friction-raster"].as<string>();
-    options._origin = parse_coordinates(vm["origin"].as<string>());
-    options._maxTimeCost = vm["max-time"].as<vector<int>>();
-    options._minFriction = vm["min-friction"].as<vector<float>>();
+    if (vm.count("input-friction-raster")) {
+      options._rasterPath = vm["input-friction-raster"].as<string>();
+    }
+    if (vm.count("origin")) {
+      const vector<string> origins = vm["origin"].as<vector<string>>();
+      for (size_t i = 0; i < origins.size(); ++i) {
+        labelled_origin_t origin = { to_string(i + 1), parse_coordinates(origins[i]) };
+        options._origins.push_back(origin);
+      }
+      options._request._origin = options._origins.front()._coords;
+    }
+    if (vm.count("population-raster")) {
+      options._request._populationPath = vm["population-raster"].as<string>();
+    }
+    if (vm.count("origins")) {
+      options._originsPath = vm["origins"].as<string>();
+    }
+    options._nearest = vm.count("nearest") > 0;
+    if (vm.count("threads")) {
+      options._threads = vm["threads"].as<unsigned>();
+    }
+    if (vm.count("max-time")) {
+      options._request._maxTimeCost = vm["max-time"].as<vector<int>>();
+    }
+    if (vm.count("min-friction")) {
+      options._request._minFriction = vm["min-friction"].as<vector<float>>();
+    }
 
-    if (!options._maxTimeCost.size()) {
-      options._maxTimeCost.push_back(DEFAULT_TIME_COST);
+    if (vm.count("levels")) {
+      for (auto& value : vm["levels"].as<vector<string>>()) {
+        vector<string> levels;
+        boost::split(levels, value, [](char c) { return c == ','; });
+        for (auto& level : levels) {
+          options._request._levels.push_back(level_minutes(parse_double(level)));
+        }
+      }
     }
-    if (!options._minFriction.size()) {
-      options._minFriction.push_back(DEFAULT_FRICTION);
+
+    check_request(options._request);
+
+    if (vm.count("format")) {
+      const string format = vm["format"].as<string>();
+      if (format == "wkt") {
+        options._format = FORMAT_WKT;
+      } else if (format == "geojson") {
+        options._format = FORMAT_GEOJSON;
+      } else {
+        cerr << "ERROR: unknown output format '" << format << "'" << endl;
+        cerr << "Run with --help for available options" << endl;
+        return false;
+      }
     }
 
-    if (options._maxTimeCost.size() != options._minFriction.size()) {
-      cerr << "ERROR: min-friction and max-time should appear the same number of times" << endl;
+    if (vm.count("verbose")) {
+      options._verbose = true;
+    }
+    options._stats = vm.count("stats") > 0;
+    if (vm.count("cost-cache")) {
+      options._costCacheDir = vm["cost-cache"].as<string>();
+    }
+
+    if (vm.count("queue")) {
+      const string queue = vm["queue"].as<string>();
+      if (queue == "dary") {
+        options._queueKind = QUEUE_DARY;
+      } else if (queue == "binomial") {
+        options._queueKind = QUEUE_BINOMIAL;
+      } else {
+        cerr << "ERROR: unknown queue '" << queue << "'" << endl;
+        cerr << "Run with --help for available options" << endl;
+        return false;
+      }
+    }
+
+    if (vm.count("layout")) {
+      const string layout = vm["layout"].as<string>();
+      if (layout == "row-major") {
+        options._layoutKind = LAYOUT_ROW_MAJOR;
+      } else if (layout == "tiled") {
+        options._layoutKind = LAYOUT_TILED;
+      } else {
+        cerr << "ERROR: unknown layout '" << layout << "'" << endl;
+        cerr << "Run with --help for available options" << endl;
+        return false;
+      }
+    }
+
+    if (vm.count("search-state")) {
+      const string state = vm["search-state"].as<string>();
+      if (state == "dense") {
+        options._stateKind = STATE_DENSE;
+      } else if (state == "sparse") {
+        options._stateKind = STATE_SPARSE;
+      } else {
+        cerr << "ERROR: unknown search state '" << state << "'" << endl;
+        cerr << "Run with --help for available options" << endl;
+        return false;
+      }
+    }
+
+    if (options._layoutKind == LAYOUT_ROW_MAJOR && options._stateKind == STATE_SPARSE) {
+      if (vm.count("search-state")) {
+        cerr << "ERROR: sparse search state requires the tiled layout" << endl;
+        cerr << "Run with --help for available options" << endl;
+        return false;
+      }
+      options._stateKind = STATE_DENSE;
+    }
+
+    if (vm.count("engine")) {
+      options._request._engine = parse_engine(vm["engine"].as<string>());
+    }
+
+    if (options._request._engine == ENGINE_PARALLEL && (options._layoutKind != LAYOUT_TILED || options._stateKind != STATE_SPARSE)) {
+      cerr << "ERROR: the parallel engine requires the tiled layout and sparse search state" << endl;
       cerr << "Run with --help for available options" << endl;
       return false;
     }
 
-    if (vm.count("verbose")) {
-      options._verbose = true;
+    if (vm.count("pyramid-factor")) {
+      options._pyramidFactor = vm["pyramid-factor"].as<int>();
+      if (options._pyramidFactor == 1 || options._pyramidFactor < 0) {
+        cerr << "ERROR: pyramid factor must be at least 2" << endl;
+        cerr << "Run with --help for available options" << endl;
+        return false;
+      }
+      if (options._pyramidFactor > 1 && options._request._engine != ENGINE_DIJKSTRA) {
+        cerr << "ERROR: the pyramid search requires the dijkstra engine" << endl;
+        cerr << "Run with --help for available options" << endl;
+        return false;
+      }
+    }
+    if (vm.count("pyramid-error")) {
+      options._pyramidError = vm["pyramid-error"].as<float>();
+      if (options._pyramidError < 0) {
+        cerr << "ERROR: pyramid error cannot be negative" << endl;
+        cerr << "Run with --help for available options" << endl;
+        return false;
+      }
+    }
+
+    if (vm.count("contour")) {
+      const string contour = vm["contour"].as<string>();
+      if (contour == "conrec") {
+        options._contourKind = CONTOUR_CONREC;
+      } else if (contour == "marching-squares") {
+        options._contourKind = CONTOUR_MARCHING_SQUARES;
+      } else {
+        cerr << "ERROR: unknown contour algorithm '" << contour << "'" << endl;
+        cerr << "Run with --help for available options" << endl;
+        return false;
+      }
     }
 
     if (vm.count("output-cost-raster")) {
-      options._outputCostPath = vm["output-cost-raster"].as<string>();
+      if (options.batch()) {
+        cerr << "ERROR: cannot output the cost raster for a batch run" << endl;
+        cerr << "Run with --help for available options" << endl;
+        return false;
+      }
+      options._request._outputCostPath = vm["output-cost-raster"].as<string>();
+    }
+
+    if (vm.count("output-label-raster")) {
+      if (!options._nearest) {
+        cerr << "ERROR: the label raster requires --nearest" << endl;
+        cerr << "Run with --help for available options" << endl;
+        return false;
+      }
+      options._request._outputLabelPath = vm["output-label-raster"].as<string>();
+    }
+
+    if (options._nearest && (options._request._engine != ENGINE_DIJKSTRA || options._pyramidFactor > 1)) {
+      cerr << "ERROR: --nearest requires the dijkstra engine without pyramid" << endl;
+      cerr << "Run with --help for available options" << endl;
+      return false;
     }
 
   } catch (exception& e) {
@@ -281,660 +505,1174 @@ parse_command_line(int argc, char *argv[], run_options_t& options)
 }
 
 
-// ======== Main algorithm
+// ======== Raster sources
 
-struct xy_with_cost_t {
-  int _x;
-  int _y;
-  float _cost;
+static GDALDataset *
+open_dataset(const string& path)
+{
+  GDALDataset *poDataset = (GDALDataset *) GDALOpen(path.c_str(), GA_ReadOnly);
+  if (poDataset == NULL) {
+    throw runtime_error("cannot open raster '" + path + "'");
+  }
+  return poDataset;
+}
+
+// Native friction file to use for the raster at `path`: the path itself if it
+// is one, or the raster with its extension replaced by the native one if
+// that is not older than the raster (to the nanosecond). Empty if there is
+// none.
+static string
+native_friction_path(const string& path)
+{
+  if (is_native_friction(path)) {
+    return path;
+  }
+  const string native = boost::filesystem::path(path).replace_extension(NATIVE_FRICTION_EXTENSION).string();
+  struct stat nativeInfo, rasterInfo;
+  if (::stat(native.c_str(), &nativeInfo) != 0 || ::stat(path.c_str(), &rasterInfo) != 0) {
+    return "";
+  }
+  const timespec& nativeTime = nativeInfo.st_mtim;
+  const timespec& rasterTime = rasterInfo.st_mtim;
+  const bool upToDate = nativeTime.tv_sec > rasterTime.tv_sec
+    || (nativeTime.tv_sec == rasterTime.tv_sec && nativeTime.tv_nsec >= rasterTime.tv_nsec);
+  if (upToDate && is_native_friction(native)) {
+    return native;
+  }
+  return "";
+}
+
+// Canonical path, size, inode and modification time (to the nanosecond) of
+// a file, which change whenever it is rewritten, or just the path if it is
+// not a file (eg. a GDAL virtual file system). The modification time in
+// seconds is returned in `mtime`, or 0 for the latter.
+static string
+file_identity(const string& path, time_t *mtime = NULL)
+{
+  namespace fs = boost::filesystem;
 
-  inline explicit xy_with_cost_t(int x, int y, float cost) : _x(x), _y(y), _cost(cost) {}
+  if (mtime != NULL) {
+    *mtime = 0;
+  }
+  boost::system::error_code error;
+  const fs::path canonical = fs::canonical(path, error);
+  struct stat info;
+  if (error || ::stat(canonical.c_str(), &info) != 0) {
+    return path;
+  }
+  if (mtime != NULL) {
+    *mtime = info.st_mtim.tv_sec;
+  }
+  ostringstream identity;
+  identity << canonical.string() << ":" << info.st_size << ":" << info.st_ino
+           << ":" << info.st_mtim.tv_sec << "." << setw(9) << setfill('0') << info.st_mtim.tv_nsec;
+  return identity.str();
+}
+
+// Raster (friction or population) read by the computations. Windows are
+// read through GDAL on demand, unless they fall into a region of the band
+// that has been decoded in memory with decode(), in which case they are
+// copied from there. Native friction files are mapped in memory instead, and
+// searched in place without reading or decoding anything.
+class raster_source_t {
+  unique_ptr<raster_t> _raster;
+  unique_ptr<native_friction_t> _native;
+  string _identity;
+  time_t _mtime;
+  float _noData;
+  unique_ptr<float[]> _band;
+  raster_window_t _bandWindow;
+  bool _decodedOnly = false;
+
+public:
+  explicit raster_source_t(const string& path) {
+    const string nativePath = native_friction_path(path);
+    if (!nativePath.empty()) {
+      _native.reset(new native_friction_t(nativePath));
+      const native_friction_header_t& header = _native->header();
+      _raster.reset(new raster_t(header._width, header._height, header._geoTransform, _native->projection()));
+      _noData = header._noData;
+    } else {
+      _raster.reset(new raster_t(open_dataset(path)));
+      _noData = _raster->dataset()->GetRasterBand(1)->GetNoDataValue();
+    }
+    if (!_raster->is_north_up()) {
+      throw runtime_error("raster must be normalized 'north-up'");
+    }
+    _identity = file_identity(nativePath.empty() ? path : nativePath, &_mtime);
+  }
+
+  const raster_t& raster() const { return *_raster; }
+  // the file read, which changes whenever it is replaced
+  const string& identity() const { return _identity; }
+  // A rewrite within the same second may keep the identity on file systems
+  // with coarser timestamps, so results of such files are not kept.
+  bool modified_this_second() const { return _mtime >= time(NULL); }
+  float no_data() const { return _noData; }
+
+  void decode() {
+    decode(_raster->full_window());
+  }
+
+  // Makes load() fail on windows outside the decoded region instead of
+  // reading them through GDAL, which is not safe from several threads.
+  void set_decoded_only(bool decodedOnly) {
+    _decodedOnly = decodedOnly;
+  }
+
+  void decode(const raster_window_t& window) {
+    if (_native) return;
+    _band = load_friction_data(_raster->dataset(), 1, window, &_noData);
+    _bandWindow = window;
+  }
 
-  inline bool operator<(const xy_with_cost_t& other) const {
-    // we want the least costly element at the top of the priority queue
-    return other._cost < _cost;
+  // The window extended to search it in place, which for native files means
+  // starting on a tile boundary.
+  raster_window_t search_window(const raster_window_t& window) const {
+    if (!_native) return window;
+    const int TILE = tiled_layout_t::TILE;
+    const int x1 = window._xOff / TILE * TILE;
+    const int y1 = window._yOff / TILE * TILE;
+    raster_window_t aligned = { x1, y1, window._xOff + window._width - x1, window._yOff + window._height - y1 };
+    return aligned;
   }
 
+  // Friction data of a window given by search_window(): the mapped tiles of
+  // native files, or otherwise the window loaded into `buffer`.
+  friction_data_t friction_data(const raster_window_t& window, unique_ptr<float[]>& buffer) const {
+    if (!_native) {
+      buffer = load(window);
+      return friction_data_t::row_major(buffer.get(), window._width);
+    }
+    const int TILE = tiled_layout_t::TILE;
+    if (window._xOff % TILE != 0 || window._yOff % TILE != 0) {
+      throw runtime_error("native friction window must start on a tile boundary");
+    }
+    return friction_data_t::tiled(_native->tiles(), _native->layout()._tilesX,
+                                  window._xOff / TILE, window._yOff / TILE);
+  }
+
+  // only thread safe if the window lies within the decoded region, or the
+  // raster is a native file
+  unique_ptr<float[]> load(const raster_window_t& window) const {
+    if (_native) {
+      const friction_data_t data = friction_data_t::tiled(_native->tiles(), _native->layout()._tilesX, 0, 0);
+      unique_ptr<float[]> pData(new float[(size_t) window._width * window._height]);
+      for (int y = 0; y < window._height; ++y) {
+        float *row = &pData[(size_t) window._width * y];
+        for (int x = 0; x < window._width; ) {
+          const int lx = window._xOff + x;
+          const int count = min(tiled_layout_t::TILE - (lx & tiled_layout_t::TILE_MASK), window._width - x);
+          const float *src = data.run(lx, window._yOff + y);
+          copy(src, src + count, row + x);
+          x += count;
+        }
+      }
+      return pData;
+    }
+    if (!_band || !_bandWindow.contains(window)) {
+      if (_decodedOnly) {
+        ostringstream message;
+        message << "window " << window << " of raster not decoded";
+        throw runtime_error(message.str());
+      }
+      float noData;
+      return load_friction_data(_raster->dataset(), 1, window, &noData);
+    }
+
+    unique_ptr<float[]> pData(new float[window._width * window._height]);
+    const int stride = _bandWindow._width;
+    for (int y = 0; y < window._height; ++y) {
+      const float *row = &_band[(window._xOff - _bandWindow._xOff)
+                                + (size_t) stride * (window._yOff - _bandWindow._yOff + y)];
+      copy(row, row + window._width, &pData[(size_t) window._width * y]);
+    }
+    return pData;
+  }
 };
 
-static unique_ptr<float[]>
-run_dijkstra_on_friction_layer(const float* pFrictionData,
-                               const int width,
-                               const int height,
-                               const float frictionNoData,
-                               const float pixelWidthMeters,
-                               const float pixelHeightMeters,
-                               const int originX,
-                               const int originY,
-                               const float maxCost,
-                               const float minFriction = 0.0f)
-{
-#ifdef BENCHMARK
-  boost::timer::auto_cpu_timer t(std::cerr, 6, "run_dijkstra_on_friction_layer: %t sec CPU, %w sec real\n");
-#endif
-
-  // initialize (lazily?) cost layer to infinity C[x] <- inf forall x
-  unique_ptr<float[]> pCost(new float[width * height]);
-  fill(&pCost[0], &pCost[width * height], 10 * maxCost /* numeric_limits<float>::infinity() */);
-
-  // add origin to priority queue Q and set the cost of origin to 0 C[o] = 0
-  typedef typename boost::heap::binomial_heap<xy_with_cost_t> queue_t;
-  typedef typename queue_t::handle_type handle_t;
-  queue_t queue;
-  pCost[originX + originY * width] = 0;
-  queue.push(xy_with_cost_t(originX, originY, 0));
-
-  vector<handle_t> handles(width * height);
-
-  int visited = 0;
-
-  const float horizCost = pixelWidthMeters;
-  const float vertCost = pixelHeightMeters;
-  const float diagCost = sqrt(horizCost * horizCost + vertCost * vertCost);
-
-  const float ndFriction = 10 * maxCost / diagCost;
-
-  // while Q is not empty
-  while (!queue.empty()) {
-    // remove the location x with the least cost from Q
-    xy_with_cost_t x = queue.top();
-    queue.pop();
-
-    visited++;
-
-    // for all neighbours n of x
-    float fx = pFrictionData[x._x + width * x._y];
-    fx = fx == frictionNoData ? ndFriction : max(fx, minFriction);
-    int nx1 = x._x > 0 ? x._x - 1 : x._x;
-    int nx2 = x._x < width-1 ? x._x + 1 : x._x;
-    int ny1 = x._y > 0 ? x._y - 1 : x._y;
-    int ny2 = x._y < height-1 ? x._y + 1 : x._y;
-    for (int nx = nx1; nx <= nx2; nx++) {
-      for (int ny = ny1; ny <= ny2; ny++) {
-        if (nx == x._x && ny == x._y) continue;
-        float d_cost = (nx == x._x) ? vertCost : ((ny == x._y) ? horizCost : diagCost);
-
-        // compute the cost from x to n d(x,n) and C' <- C[x] + d(x,n)
-        float cn = pCost[nx + width * ny];
-        float fn = pFrictionData[nx + width * ny];
-        fn = fn == frictionNoData ? ndFriction : max(fn, minFriction);
-        float dxn = (fx + fn) / 2 * d_cost;
-        // friction is given in minutes/meter
-        float cn_from_x = x._cost + dxn;
-
-        // if C[n] > C', C[n] <- C'
-        if (cn > cn_from_x) {
-          pCost[nx + width * ny] = cn_from_x;
-
-          // if C' < maxCost, add (or update) n to the visit queue
-          if (cn_from_x < maxCost) {
-            handle_t handle = handles[nx + width * ny];
-            if (handle == handle_t()) {
-              handles[nx + width * ny] = queue.push(xy_with_cost_t(nx, ny, cn_from_x));
-            } else {
-              queue.update(handle, xy_with_cost_t(nx, ny, cn_from_x));
-            }
-          }
+// LRU cache of decoded rasters, keyed by path and the identity of the file
+// actually read (the native friction file when it is up to date), so that a
+// replaced raster or native file is read again.
+class raster_cache_t {
+  struct entry_t {
+    string _path;
+    string _identity;
+    shared_ptr<raster_source_t> _source;
+  };
+
+  list<entry_t> _entries; // most recently used first
+  size_t _capacity;
+
+public:
+  explicit raster_cache_t(size_t capacity) : _capacity(capacity) {}
+
+  shared_ptr<const raster_source_t> get(const string& path) {
+    const string nativePath = native_friction_path(path);
+    const string identity = file_identity(nativePath.empty() ? path : nativePath);
+
+    for (auto it = _entries.begin(); it != _entries.end(); ++it) {
+      if (it->_path == path) {
+        if (it->_identity == identity) {
+          _entries.splice(_entries.begin(), _entries, it);
+          return _entries.front()._source;
         }
+        _entries.erase(it);
+        break;
       }
     }
+
+    shared_ptr<raster_source_t> source(new raster_source_t(path));
+    source->decode();
+    if (source->modified_this_second()) {
+      // a rewrite within this second may not change its identity
+      return source;
+    }
+    _entries.push_front(entry_t { path, source->identity(), source });
+    while (_entries.size() > _capacity) {
+      _entries.pop_back();
+    }
+    return source;
+  }
+};
+
+
+// ======== Cost surface cache
+
+// merged cost of all transport layers over the part of the raster reached
+struct cost_surface_t {
+  raster_window_t _window;
+  unique_ptr<float[]> _cost;
+  // for the cost surface cache: the costs of every transport layer before
+  // merging, and the maximum cost each one was searched up to
+  vector<unique_ptr<float[]>> _layers;
+  vector<float> _budgets;
+};
+
+// Cost surfaces are kept as compressed GeoTIFFs of the window reached, one
+// for every origin pixel and search settings: the friction file, the engine,
+// and the minimum friction and relative max-time of every transport layer
+// (and the levels the pyramid search refines around).
+// The max-time of the first layer only bounds how far the search goes, so it
+// is left out of the key and the costs of every layer are kept (one band
+// each) with the maximum cost they were searched up to instead. They serve
+// any request on the same key whose levels are within the first one (its
+// reach), and searches further out carry on from them. The key, budgets and
+// window are kept in the metadata.
+namespace {
+  const char *COST_SURFACE_KEY = "WALKING_COVERAGE_KEY";
+  const char *COST_SURFACE_BUDGETS = "WALKING_COVERAGE_BUDGETS";
+  const char *COST_SURFACE_WINDOW = "WALKING_COVERAGE_WINDOW";
+}
+
+static string
+cost_surface_key(const raster_source_t& frictionSource,
+                 const pixel_coords_t& origin,
+                 const coverage_request_t& request,
+                 const run_options_t& options)
+{
+  ostringstream key;
+  key << setprecision(9)
+      << "raster=" << frictionSource.identity()
+      << ";origin=" << origin.first << "," << origin.second
+      << ";engine=" << engine_name(request._engine);
+  if (request._engine == ENGINE_DIJKSTRA && options._pyramidFactor > 1) {
+    // only blocks crossed by the levels are sure to be refined
+    key << ";pyramid=" << options._pyramidFactor << "," << options._pyramidError << ";levels=";
+    for (size_t i = 0; i < request._levels.size(); ++i) {
+      key << (i ? "," : "") << request._levels[i];
+    }
+  }
+  for (size_t i = 0; i < request._maxTimeCost.size(); ++i) {
+    key << ";layer=" << (float) request._maxTimeCost[i] / request._maxTimeCost[0]
+        << "," << request._minFriction[i];
   }
+  return key.str();
+}
 
-#ifdef BENCHMARK
-  cerr << "visited " << visited << endl;
-#endif
+// file of the cache directory for the key, named by its FNV-1a hash
+static string
+cost_surface_path(const string& directory, const string& key)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  for (unsigned char c : key) {
+    hash = (hash ^ c) * 1099511628211ULL;
+  }
+  ostringstream name;
+  name << hex << setw(16) << setfill('0') << hash << ".tif";
+  return (boost::filesystem::path(directory) / name.str()).string();
+}
 
-  // return the resulting C layer
-  return pCost;
+// Reads the layers kept at `path` and their budgets into `surface`, if they
+// are those of `key`. Unreadable files are left to be replaced.
+static bool
+read_cost_surface(const string& path, const string& key, size_t layerCount, cost_surface_t& surface)
+{
+  boost::system::error_code error;
+  if (!boost::filesystem::exists(path, error)) {
+    return false;
+  }
+  GDALDataset *pDataset = (GDALDataset *) GDALOpen(path.c_str(), GA_ReadOnly);
+  if (pDataset == NULL) {
+    return false;
+  }
+
+  const char *storedKey = pDataset->GetMetadataItem(COST_SURFACE_KEY);
+  const char *storedBudgets = pDataset->GetMetadataItem(COST_SURFACE_BUDGETS);
+  const char *storedWindow = pDataset->GetMetadataItem(COST_SURFACE_WINDOW);
+  raster_window_t window = { 0, 0, pDataset->GetRasterXSize(), pDataset->GetRasterYSize() };
+  bool found = storedKey != NULL && key == storedKey && storedBudgets != NULL
+    && storedWindow != NULL && sscanf(storedWindow, "%d,%d", &window._xOff, &window._yOff) == 2
+    && pDataset->GetRasterCount() == (int) layerCount;
+  if (found) {
+    try {
+      const string budgetList(storedBudgets);
+      vector<string> budgets;
+      boost::split(budgets, budgetList, [](char c) { return c == ','; });
+      surface._budgets.clear();
+      for (auto& budget : budgets) {
+        surface._budgets.push_back((float) parse_double(budget));
+      }
+      found = surface._budgets.size() == layerCount;
+
+      const raster_window_t band = { 0, 0, window._width, window._height };
+      surface._layers.clear();
+      for (size_t i = 0; found && i < layerCount; ++i) {
+        float noData;
+        surface._layers.push_back(load_friction_data(pDataset, (int) i + 1, band, &noData));
+      }
+      surface._window = window;
+    } catch (runtime_error&) {
+      found = false;
+    }
+  }
+  GDALClose(pDataset);
+  return found;
 }
 
-static unique_ptr<float[]>
-load_friction_data(GDALDataset *pDataset, int rasterNumber, int* pWidth, int *pHeight, float *pNoData)
+// Keeps the layers of the surface of `key`, replacing any previous ones. They
+// are written under a temporary name and then renamed, so that other threads
+// or processes never read a partial file.
+static void
+write_cost_surface(const string& path, const string& key,
+                   const raster_t& frictionRaster, const cost_surface_t& surface)
 {
-#ifdef BENCHMARK
-  boost::timer::auto_cpu_timer t(std::cerr, 6, "load_friction_data: %t sec CPU, %w sec real\n");
-#endif
-
-  GDALRasterBand *pRasterBand = pDataset->GetRasterBand(rasterNumber);
-  *pWidth = pRasterBand->GetXSize();
-  *pHeight = pRasterBand->GetYSize();
-  *pNoData = pRasterBand->GetNoDataValue();
-  unique_ptr<float[]> pData(new float[*pWidth * *pHeight]);
-
-  CPLErr result = pRasterBand->RasterIO(GF_Read,       // eRWFlag
-                                        0,             // nXOff
-                                        0,             // nYOff
-                                        *pWidth,       // nXSize
-                                        *pHeight,      // nYSize
-                                        pData.get(),   // pData
-                                        *pWidth,       // nBufXSize
-                                        *pHeight,      // nBufYSize
-                                        GDT_Float32,   // eBufType
-                                        0,             // nPixelSpace
-                                        0);            // nLineSpace
-
-  if (result != CE_None) {
-    throw runtime_error("failed to read friction raster data");
-  }
-
-  return pData;
+  namespace fs = boost::filesystem;
+  static atomic<unsigned> sequence(0);
+
+  fs::create_directories(fs::path(path).parent_path());
+  const string tmpPath = path + "." + to_string(getpid()) + "." + to_string(sequence++) + ".tmp";
+
+  ostringstream budgets;
+  budgets << setprecision(9);
+  for (size_t i = 0; i < surface._budgets.size(); ++i) {
+    budgets << (i ? "," : "") << surface._budgets[i];
+  }
+  const raster_metadata_t metadata = {
+    { COST_SURFACE_KEY, key },
+    { COST_SURFACE_BUDGETS, budgets.str() },
+    { COST_SURFACE_WINDOW, to_string(surface._window._xOff) + "," + to_string(surface._window._yOff) }
+  };
+  vector<const void *> bands;
+  for (auto& layer : surface._layers) {
+    bands.push_back(layer.get());
+  }
+  try {
+    write_raster_layers(tmpPath, frictionRaster, surface._window, bands,
+                        GDT_Float32, numeric_limits<float>::infinity(), metadata);
+    fs::rename(tmpPath, path);
+  } catch (...) {
+    boost::system::error_code error;
+    fs::remove(tmpPath, error);
+    throw;
+  }
 }
 
+// Keeps only the costs of the surface within a window of it.
+static void
+crop_cost_surface(cost_surface_t& surface, const raster_window_t& window)
+{
+  const raster_window_t& from = surface._window;
+  unique_ptr<float[]> cost(new float[(size_t) window._width * window._height]);
+  for (int y = 0; y < window._height; ++y) {
+    const float *row = &surface._cost[(size_t) (window._yOff - from._yOff + y) * from._width
+                                      + (window._xOff - from._xOff)];
+    copy(row, row + window._width, &cost[(size_t) y * window._width]);
+  }
+  surface._window = window;
+  surface._cost = move(cost);
+}
 
+// Merges the cached layers of the surface into its cost, as after a search.
 static void
-write_cost_layer(const string& filename, GDALDataset *pSource, const float data[], int width, int height)
+merge_cached_layers(cost_surface_t& surface, const coverage_request_t& request, unsigned threads)
+{
+  const size_t size = (size_t) surface._window._width * surface._window._height;
+  surface._cost.reset(new float[size]);
+  copy(&surface._layers[0][0], &surface._layers[0][0] + size, surface._cost.get());
+
+  vector<const float *> layers;
+  vector<float> layerMaxCosts;
+  for (size_t i = 1; i < surface._layers.size(); ++i) {
+    layers.push_back(surface._layers[i].get());
+    layerMaxCosts.push_back(request._maxTimeCost[i]);
+  }
+  if (!layers.empty()) {
+    merge_cost_layers(surface._cost.get(), layers, surface._window._width, surface._window._height,
+                      request._maxTimeCost[0], layerMaxCosts, threads);
+  }
+}
+
+
+// ======== Coverage computation
+
+static int
+polygon_ring_count(const OGRPolygon& polygon)
 {
-  const char *pszFormat = "GTiff";
-  GDALDriver *poDriver;
-  char **papszMetadata;
+  return polygon.getExteriorRing() != NULL ? 1 + polygon.getNumInteriorRings() : 0;
+}
 
-  poDriver = GetGDALDriverManager()->GetDriverByName(pszFormat);
-  if (poDriver == NULL) {
-    throw runtime_error("cannot retrieve GeoTIFF driver");
+static int
+polygon_vertex_count(const OGRPolygon& polygon)
+{
+  if (polygon.getExteriorRing() == NULL) return 0;
+  int count = polygon.getExteriorRing()->getNumPoints();
+  for (int i = 0; i < polygon.getNumInteriorRings(); ++i) {
+    count += polygon.getInteriorRing(i)->getNumPoints();
   }
-  papszMetadata = poDriver->GetMetadata();
-  if (!CSLFetchBoolean(papszMetadata, GDAL_DCAP_CREATE, FALSE)) {
-    throw runtime_error("driver cannot create new layers");
+  return count;
+}
+
+// Runs a single search up to the largest level of the request, or carries
+// on the one of `previous` (given with its layers and budgets) if it fits in
+// the window searched. With `keepLayers`, the surface keeps the costs of
+// every layer for the cost surface cache.
+static cost_surface_t
+search_cost_surface(const raster_source_t& frictionSource,
+                    const coverage_request_t& request,
+                    const run_options_t& options,
+                    unsigned threads,
+                    run_stats_t *stats,
+                    const cost_surface_t *previous = NULL,
+                    bool keepLayers = false)
+{
+  const raster_t& frictionRaster = frictionSource.raster();
+  const vector<float> budgets = search_budgets(request);
+  const bool nearest = !request._origins.empty();
+  const vector<coords_t> origins = nearest ? request._origins : vector<coords_t>(1, request._origin);
+
+  // only the pixels reachable from the origins are loaded and searched, so
+  // from here on all pixel coordinates are relative to the window
+  vector<pixel_coords_t> pixelOrigins;
+  raster_window_t reachable = { 0, 0, 0, 0 };
+  for (size_t i = 0; i < origins.size(); ++i) {
+    if (options._verbose) {
+      cerr << "Using origin at " << origins[i] << endl;
+    }
+
+    if (!frictionRaster.contains(origins[i])) {
+      if (!nearest) {
+        throw runtime_error("origin out of raster boundaries");
+      }
+      // left out of the search, but keeps its number for the labels
+      cerr << "Origin " << (i + 1) << " out of raster boundaries, skipped" << endl;
+      pixelOrigins.push_back(make_pixel_coords(-1, -1));
+      continue;
+    }
+
+    pixel_coords_t pixelOrigin(frictionRaster.pixel_coords(origins[i]));
+    if (options._verbose) {
+      cerr << "Pixel origin at " << pixelOrigin << endl;
+    }
+    pixelOrigins.push_back(pixelOrigin);
+    reachable = reachable.merge(reachable_window(frictionRaster, pixelOrigin, budgets, request._minFriction));
+  }
+  if (reachable.empty()) {
+    throw runtime_error("all origins out of raster boundaries");
   }
 
-  GDALDataset *pDataset;
-  char **ppOptions = NULL;
-  ppOptions = CSLSetNameValue(ppOptions, "COMPRESS", "DEFLATE");
-  // ppOptions = CSLSetNameValue(ppOptions, "PREDICTOR", "3");
-  pDataset = poDriver->Create(filename.c_str(), width, height, 1, GDT_Float32, ppOptions);
-  CSLDestroy(ppOptions);
+  const raster_window_t window = frictionSource.search_window(reachable);
+  if (options._verbose) {
+    cerr << "Using friction window " << window << endl;
+  }
 
-  double geoTransform[6];
-  if (pSource->GetGeoTransform(geoTransform) != CE_None) {
-    throw runtime_error("cannot retrieve geotransform of source layer");
+  for (auto& pixelOrigin : pixelOrigins) {
+    if (pixelOrigin.first < 0) continue;
+    pixelOrigin.first -= window._xOff;
+    pixelOrigin.second -= window._yOff;
+  }
+  const int originX = pixelOrigins[0].first;
+  const int originY = pixelOrigins[0].second;
+  const float nodata = frictionSource.no_data();
+  phase_timer_t loadTimer(stats, "load");
+  unique_ptr<float[]> buffer;
+  const friction_data_t friction = frictionSource.friction_data(window, buffer);
+  loadTimer.stop();
+  if (stats != NULL) {
+    stats->add_counter("pixels_loaded", (double) window._width * window._height);
   }
 
-  pDataset->SetGeoTransform(geoTransform);
-  pDataset->SetProjection(pSource->GetProjectionRef());
+  const int maxTimeCost = request._maxTimeCost[0]; // minutes
 
-  GDALRasterBand *pBand = pDataset->GetRasterBand(1);
-  pBand->SetNoDataValue(numeric_limits<float>::infinity());
+  const size_t layerCount = request._maxTimeCost.size();
+  if (options._pyramidFactor > 1 && request._engine != ENGINE_DIJKSTRA) {
+    throw runtime_error("the pyramid search requires the dijkstra engine");
+  }
+  if (nearest && (request._engine != ENGINE_DIJKSTRA || options._pyramidFactor > 1)) {
+    throw runtime_error("searching from several origins at once requires the dijkstra engine without pyramid");
+  }
 
-  CPLErr result = pBand->RasterIO(GF_Write,      // eRWFlag
-                                  0,             // nXOff
-                                  0,             // nYOff
-                                  width,         // nXSize
-                                  height,        // nYSize
-                                  (void *) data, // pData
-                                  width,         // nBufXSize
-                                  height,        // nBufYSize
-                                  GDT_Float32,   // eBufType
-                                  0,             // nPixelSpace
-                                  0);            // nLineSpace
+  search_result_t search;
+  if (previous != NULL && window.contains(previous->_window)) {
+    const raster_window_t previousWindow = { previous->_window._xOff - window._xOff, previous->_window._yOff - window._yOff,
+                                             previous->_window._width, previous->_window._height };
+    vector<const float *> previousCosts;
+    for (auto& layer : previous->_layers) {
+      previousCosts.push_back(layer.get());
+    }
+    if (options._verbose) {
+      cerr << "Resuming search from window " << previous->_window << endl;
+    }
+    search = run_resumed_search(friction,
+                                window._width, window._height, nodata,
+                                frictionRaster.pixel_width_meters(),
+                                frictionRaster.pixel_height_meters(),
+                                previousCosts, previousWindow, previous->_budgets,
+                                budgets,
+                                request._minFriction,
+                                options._queueKind,
+                                threads,
+                                stats);
+  } else if (nearest) {
+    search = run_nearest_search(friction,
+                                window._width, window._height, nodata,
+                                frictionRaster.pixel_width_meters(),
+                                frictionRaster.pixel_height_meters(),
+                                pixelOrigins,
+                                budgets,
+                                request._minFriction,
+                                options._queueKind,
+                                threads,
+                                stats);
+  } else if (request._engine == ENGINE_SWEEP) {
+    search = run_sweep_search(friction,
+                              window._width, window._height, nodata,
+                              frictionRaster.pixel_width_meters(),
+                              frictionRaster.pixel_height_meters(),
+                              originX, originY,
+                              budgets,
+                              request._minFriction,
+                              threads,
+                              stats);
+  } else if (request._engine == ENGINE_PARALLEL) {
+    search = run_parallel_search(friction,
+                                 window._width, window._height, nodata,
+                                 frictionRaster.pixel_width_meters(),
+                                 frictionRaster.pixel_height_meters(),
+                                 originX, originY,
+                                 budgets,
+                                 request._minFriction,
+                                 threads,
+                                 stats);
+  } else if (options._pyramidFactor > 1) {
+    const pyramid_options_t pyramid = { options._pyramidFactor, options._pyramidError,
+                                        vector<float>(request._levels.begin(), request._levels.end()) };
+    search = run_pyramid_search(friction,
+                                window._width, window._height, nodata,
+                                frictionRaster.pixel_width_meters(),
+                                frictionRaster.pixel_height_meters(),
+                                originX, originY,
+                                budgets,
+                                request._minFriction,
+                                pyramid,
+                                threads,
+                                stats);
+  } else {
+    search = run_dijkstra_on_friction_layers(friction,
+                                             window._width, window._height, nodata,
+                                             frictionRaster.pixel_width_meters(),
+                                             frictionRaster.pixel_height_meters(),
+                                             originX, originY,
+                                             budgets,
+                                             request._minFriction,
+                                             options._queueKind,
+                                             options._layoutKind,
+                                             options._stateKind,
+                                             threads,
+                                             stats);
+  }
+  buffer.reset();
 
-  if (result != CE_None) {
-    throw runtime_error("failed to write cost raster data");
+  // the costs may cover only the searched part of the friction window
+  const raster_window_t costWindow = { window._xOff + search._window._xOff, window._yOff + search._window._yOff,
+                                       search._window._width, search._window._height };
+  const int width = costWindow._width;
+  const int height = costWindow._height;
+  if (options._verbose) {
+    cerr << "Search reached window " << costWindow << endl;
   }
 
-  GDALClose(pDataset);
-}
+  vector<unique_ptr<float[]>>& layerCosts = search._costs;
+  cost_surface_t surface;
+  surface._window = costWindow;
+  if (keepLayers) {
+    // the base layer is merged in place, so it is kept as a copy
+    const size_t size = (size_t) width * height;
+    surface._layers.emplace_back(new float[size]);
+    copy(&layerCosts[0][0], &layerCosts[0][0] + size, surface._layers[0].get());
+    surface._budgets = budgets;
+  }
+  unique_ptr<float[]> cost(move(layerCosts[0]));
+  if (nearest && layerCount > 1) {
+    // the nearest origin of every pixel is the one of the layer it is
+    // taken from
+    phase_timer_t timer(stats, "merge");
+    vector<const float *> layers;
+    vector<const int32_t *> layerLabels;
+    vector<float> layerMaxCosts;
+    for (size_t i = 1; i < layerCount; ++i) {
+      layers.push_back(layerCosts[i].get());
+      layerLabels.push_back(search._labels[i].get());
+      layerMaxCosts.push_back(request._maxTimeCost[i]);
+    }
+    merge_labelled_cost_layers(cost.get(), search._labels[0].get(), layers, layerLabels,
+                               width, height, maxTimeCost, layerMaxCosts);
+  } else if (layerCount > 1) {
+    phase_timer_t timer(stats, "merge");
+    // To calculate the isochrone at `maxTimeCost` level
+    // the other layers have to be scaled before merging
+    // with the base layer `cost`
+    vector<const float *> layers;
+    vector<float> layerMaxCosts;
+    for (size_t i = 1; i < layerCount; ++i) {
+      layers.push_back(layerCosts[i].get());
+      layerMaxCosts.push_back(request._maxTimeCost[i]);
+    }
+    merge_cost_layers(cost.get(), layers, width, height, maxTimeCost, layerMaxCosts, threads);
+  }
+
+  if (!request._outputLabelPath.empty() && nearest) {
+    phase_timer_t timer(stats, "write_label_raster");
+    write_label_layer(request._outputLabelPath, frictionRaster, costWindow, search._labels[0].get());
+    if (options._verbose) {
+      cerr << "Wrote " << request._outputLabelPath << endl;
+    }
+  }
 
+  for (size_t i = 1; keepLayers && i < layerCount; ++i) {
+    surface._layers.push_back(move(layerCosts[i]));
+  }
+  surface._cost = move(cost);
+  return surface;
+}
 
-// ======== Contour algorithm
-
-#define xsect(p1,p2) (h[p2]*xh[p1]-h[p1]*xh[p2])/(h[p2]-h[p1])
-#define ysect(p1,p2) (h[p2]*yh[p1]-h[p1]*yh[p2])/(h[p2]-h[p1])
-
-typedef function<void(double,double,double,double,float)> contour_callback_t;
-
-/*
-Copyright (c) 1996-1997 Nicholas Yue
-
-This software is copyrighted by Nicholas Yue. This code is base on the work of
-Paul D. Bourke CONREC.F routine
-
-The authors hereby grant permission to use, copy, and distribute this
-software and its documentation for any purpose, provided that existing
-copyright notices are retained in all copies and that this notice is included
-verbatim in any distributions. Additionally, the authors grant permission to
-modify this software and its documentation for any purpose, provided that
-such modifications are not distributed without the explicit consent of the
-authors and that existing copyright notices are retained in all copies. Some
-of the algorithms implemented by this software are patented, observe all
-applicable patent law.
-
-IN NO EVENT SHALL THE AUTHORS OR DISTRIBUTORS BE LIABLE TO ANY PARTY FOR
-DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES ARISING OUT
-OF THE USE OF THIS SOFTWARE, ITS DOCUMENTATION, OR ANY DERIVATIVES THEREOF,
-EVEN IF THE AUTHORS HAVE BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
-
-THE AUTHORS AND DISTRIBUTORS SPECIFICALLY DISCLAIM ANY WARRANTIES, INCLUDING,
-BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
-PARTICULAR PURPOSE, AND NON-INFRINGEMENT.  THIS SOFTWARE IS PROVIDED ON AN
-"AS IS" BASIS, AND THE AUTHORS AND DISTRIBUTORS HAVE NO OBLIGATION TO PROVIDE
-MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
-*/
-
-//=============================================================================
-//
-//     CONREC is a contouring subroutine for rectangularily spaced data.
-//
-//     It emits calls to a line drawing subroutine supplied by the user
-//     which draws a contour map corresponding to real*4data on a randomly
-//     spaced rectangular grid. The coordinates emitted are in the same
-//     units given in the x() and y() arrays.
-//
-//     Any number of contour levels may be specified but they must be
-//     in order of increasing value.
-//
-//     As this code is ported from FORTRAN-77, please be very careful of the
-//     various indices like ilb,iub,jlb and jub, remeber that C/C++ indices
-//     starts from zero (0)
-//
-//=============================================================================
-int conrec(const float * const *d,
-           int ilb,
-           int iub,
-           int jlb,
-           int jub,
-           double *x,
-           double *y,
-           int nc,
-           float *z,
-           const contour_callback_t& callback)
-// d               ! matrix of data to contour
-// ilb,iub,jlb,jub ! index bounds of data matrix
-// x               ! data matrix column coordinates
-// y               ! data matrix row coordinates
-// nc              ! number of contour levels
-// z               ! contour levels in increasing order
+// Gets the cost surface of the request from the cost surface cache, or
+// searches it (carrying on from the cached one when it does not reach far
+// enough) and keeps it there, and writes the cost raster if one is
+// requested. Only single origins within the raster are cached.
+static cost_surface_t
+compute_cost_surface(const raster_source_t& frictionSource,
+                     const coverage_request_t& request,
+                     const run_options_t& options,
+                     unsigned threads,
+                     run_stats_t *stats)
 {
-  int m1,m2,m3,case_value;
-  float dmin,dmax;
-  double x1,x2,y1,y2;
-  int i,j,k,m;
-  float h[5];
-  int sh[5];
-  double xh[5],yh[5];
-  //===========================================================================
-  // The indexing of im and jm should be noted as it has to start from zero
-  // unlike the fortran counter part
-  //===========================================================================
-  int im[4] = {0,1,1,0}, jm[4] = {0,0,1,1};
-  //===========================================================================
-  // Note that castab is arranged differently from the FORTRAN code because
-  // Fortran and C/C++ arrays are transposed of each other, in this case
-  // it is more tricky as castab is in 3 dimension
-  //===========================================================================
-  int castab[3][3][3] =
-    {
-      {
-        {0,0,8},{0,2,5},{7,6,9}
-      },
-      {
-        {0,3,4},{1,3,1},{4,3,0}
-      },
-      {
-        {9,6,7},{5,2,0},{8,0,0}
+  const raster_t& frictionRaster = frictionSource.raster();
+  const bool cached = !options._costCacheDir.empty() && request._origins.empty()
+    && frictionRaster.contains(request._origin);
+  const bool storable = cached && !frictionSource.modified_this_second();
+  // only exact searches can be carried on
+  const bool resumable = request._engine == ENGINE_DIJKSTRA && options._pyramidFactor <= 1;
+  const vector<float> budgets = search_budgets(request);
+
+  cost_surface_t surface, previous;
+  string cacheKey, cachePath;
+  bool hit = false, resume = false;
+  if (cached) {
+    phase_timer_t timer(stats, "read_cost_cache");
+    cacheKey = cost_surface_key(frictionSource, frictionRaster.pixel_coords(request._origin), request, options);
+    cachePath = cost_surface_path(options._costCacheDir, cacheKey);
+    if (read_cost_surface(cachePath, cacheKey, budgets.size(), previous)) {
+      hit = previous._budgets[0] >= budgets[0];
+      resume = !hit && resumable;
+      for (size_t i = 0; i < budgets.size(); ++i) {
+        resume = resume && previous._budgets[i] <= budgets[i];
       }
-    };
-  for (j=(jub-1);j>=jlb;j--) {
-    for (i=ilb;i<=iub-1;i++) {
-      float temp1,temp2;
-      temp1 = min(d[i][j],d[i][j+1]);
-      temp2 = min(d[i+1][j],d[i+1][j+1]);
-      dmin = min(temp1,temp2);
-      temp1 = max(d[i][j],d[i][j+1]);
-      temp2 = max(d[i+1][j],d[i+1][j+1]);
-      dmax = max(temp1,temp2);
-      if (dmax>=z[0]&&dmin<=z[nc-1]) {
-        for (k=0;k<nc;k++) {
-          if (z[k]>=dmin&&z[k]<=dmax) {
-            for (m=4;m>=0;m--) {
-              if (m>0) {
-                //=============================================================
-                // The indexing of im and jm should be noted as it has to
-                // start from zero
-                //=============================================================
-                h[m] = d[i+im[m-1]][j+jm[m-1]]-z[k];
-                xh[m] = x[i+im[m-1]];
-                yh[m] = y[j+jm[m-1]];
-              } else {
-                h[0] = 0.25*(h[1]+h[2]+h[3]+h[4]);
-                xh[0]=0.5*(x[i]+x[i+1]);
-                yh[0]=0.5*(y[j]+y[j+1]);
-              }
-              if (h[m]>0.0) {
-                sh[m] = 1;
-              } else if (h[m]<0.0) {
-                sh[m] = -1;
-              } else
-                sh[m] = 0;
-            }
-            //=================================================================
-            //
-            // Note: at this stage the relative heights of the corners and the
-            // centre are in the h array, and the corresponding coordinates are
-            // in the xh and yh arrays. The centre of the box is indexed by 0
-            // and the 4 corners by 1 to 4 as shown below.
-            // Each triangle is then indexed by the parameter m, and the 3
-            // vertices of each triangle are indexed by parameters m1,m2,and
-            // m3.
-            // It is assumed that the centre of the box is always vertex 2
-            // though this isimportant only when all 3 vertices lie exactly on
-            // the same contour level, in which case only the side of the box
-            // is drawn.
-            //
-            //
-            //      vertex 4 +-------------------+ vertex 3
-            //               | \               / |
-            //               |   \    m-3    /   |
-            //               |     \       /     |
-            //               |       \   /       |
-            //               |  m=2    X   m=2   |       the centre is vertex 0
-            //               |       /   \       |
-            //               |     /       \     |
-            //               |   /    m=1    \   |
-            //               | /               \ |
-            //      vertex 1 +-------------------+ vertex 2
-            //
-            //
-            //
-            //               Scan each triangle in the box
-            //
-            //=================================================================
-            for (m=1;m<=4;m++) {
-              m1 = m;
-              m2 = 0;
-              if (m!=4)
-                m3 = m+1;
-              else
-                m3 = 1;
-              case_value = castab[sh[m1]+1][sh[m2]+1][sh[m3]+1];
-              if (case_value!=0) {
-                switch (case_value) {
-                  //===========================================================
-                  //     Case 1 - Line between vertices 1 and 2
-                  //===========================================================
-                case 1:
-                  x1=xh[m1];
-                  y1=yh[m1];
-                  x2=xh[m2];
-                  y2=yh[m2];
-                  break;
-                  //===========================================================
-                  //     Case 2 - Line between vertices 2 and 3
-                  //===========================================================
-                case 2:
-                  x1=xh[m2];
-                  y1=yh[m2];
-                  x2=xh[m3];
-                  y2=yh[m3];
-                  break;
-                  //===========================================================
-                  //     Case 3 - Line between vertices 3 and 1
-                  //===========================================================
-                case 3:
-                  x1=xh[m3];
-                  y1=yh[m3];
-                  x2=xh[m1];
-                  y2=yh[m1];
-                  break;
-                  //===========================================================
-                  //     Case 4 - Line between vertex 1 and side 2-3
-                  //===========================================================
-                case 4:
-                  x1=xh[m1];
-                  y1=yh[m1];
-                  x2=xsect(m2,m3);
-                  y2=ysect(m2,m3);
-                  break;
-                  //===========================================================
-                  //     Case 5 - Line between vertex 2 and side 3-1
-                  //===========================================================
-                case 5:
-                  x1=xh[m2];
-                  y1=yh[m2];
-                  x2=xsect(m3,m1);
-                  y2=ysect(m3,m1);
-                  break;
-                  //===========================================================
-                  //     Case 6 - Line between vertex 3 and side 1-2
-                  //===========================================================
-                case 6:
-                  x1=xh[m3];
-                  y1=yh[m3];
-                  x2=xsect(m1,m2);
-                  y2=ysect(m1,m2);
-                  break;
-                  //===========================================================
-                  //     Case 7 - Line between sides 1-2 and 2-3
-                  //===========================================================
-                case 7:
-                  x1=xsect(m1,m2);
-                  y1=ysect(m1,m2);
-                  x2=xsect(m2,m3);
-                  y2=ysect(m2,m3);
-                  break;
-                  //===========================================================
-                  //     Case 8 - Line between sides 2-3 and 3-1
-                  //===========================================================
-                case 8:
-                  x1=xsect(m2,m3);
-                  y1=ysect(m2,m3);
-                  x2=xsect(m3,m1);
-                  y2=ysect(m3,m1);
-                  break;
-                  //===========================================================
-                  //     Case 9 - Line between sides 3-1 and 1-2
-                  //===========================================================
-                case 9:
-                  x1=xsect(m3,m1);
-                  y1=ysect(m3,m1);
-                  x2=xsect(m1,m2);
-                  y2=ysect(m1,m2);
-                  break;
-                default:
-                  throw runtime_error("unexpected contour case");
-                  break;
-                }
-                //=============================================================
-                // Put your processing code here and comment out the printf
-                //=============================================================
-                callback(x1, y1, x2, y2, z[k]);
-              }
-            }
-          }
-        }
+    }
+    if (hit) {
+      surface = move(previous);
+      merge_cached_layers(surface, request, threads);
+    }
+    if (stats != NULL) {
+      stats->add_counter(hit ? "cost_cache_hits" : (resume ? "cost_cache_resumes" : "cost_cache_misses"), 1);
+    }
+    if (options._verbose && hit) {
+      cerr << "Using cached cost surface " << cachePath << endl;
+    }
+  }
+
+  if (!hit) {
+    surface = search_cost_surface(frictionSource, request, options, threads, stats,
+                                  resume ? &previous : NULL, storable);
+    if (storable) {
+      phase_timer_t timer(stats, "write_cost_cache");
+      try {
+        write_cost_surface(cachePath, cacheKey, frictionRaster, surface);
+      } catch (exception& e) {
+        cerr << "Failed to cache cost surface: " << e.what() << endl;
       }
     }
   }
-  return 0;
+  surface._layers.clear();
+
+  // a cached surface (or one searched on tile boundaries) may be larger
+  // than the window the request can reach, which is all that batch runs
+  // decode of the population raster
+  if (request._origins.empty()) {
+    const raster_window_t reachable = reachable_window(frictionRaster, frictionRaster.pixel_coords(request._origin),
+                                                       budgets, request._minFriction);
+    if (!reachable.contains(surface._window)) {
+      crop_cost_surface(surface, reachable.intersect(surface._window));
+    }
+  }
+
+  if (!request._outputCostPath.empty()) {
+    phase_timer_t timer(stats, "write_cost_raster");
+    write_cost_layer(request._outputCostPath, frictionRaster, surface._window, surface._cost.get());
+    if (options._verbose) {
+      cerr << "Wrote " << request._outputCostPath << endl;
+    }
+  }
+
+  return surface;
 }
 
-inline bool
-coordsEqual(const coords_t& a, const coords_t& b) {
-  double df = a.first - b.first;
-  double ds = a.second - b.second;
-  return df * df + ds * ds < 1e-16;
+// Computes the coverage polygon of every level of the request.
+static vector<unique_ptr<OGRGeometry>>
+compute_isochrones(const raster_source_t& frictionSource,
+                   const coverage_request_t& request,
+                   const run_options_t& options,
+                   unsigned threads,
+                   run_stats_t *stats = NULL)
+{
+  const raster_t& frictionRaster = frictionSource.raster();
+  const cost_surface_t surface = compute_cost_surface(frictionSource, request, options, threads, stats);
+  const raster_window_t& costWindow = surface._window;
+
+  const vector<float> levels(request._levels.begin(), request._levels.end());
+  vector<unique_ptr<OGRGeometry>> isochrones = extract_isochrones(surface._cost.get(), costWindow._width, costWindow._height, frictionRaster.top_left_coords(costWindow), frictionRaster.bottom_right_coords(costWindow), levels, options._contourKind, stats);
+
+  phase_timer_t simplifyTimer(stats, "simplify");
+  for (auto& isochrone : isochrones) {
+    if (stats != NULL) {
+      const OGRPolygon& polygon = (const OGRPolygon&) *isochrone;
+      stats->add_counter("contour_rings", polygon_ring_count(polygon));
+      stats->add_counter("vertices_before_simplify", polygon_vertex_count(polygon));
+    }
+    OGRGeometry *simplified = isochrone->SimplifyPreserveTopology(min(frictionRaster.pixel_width(), frictionRaster.pixel_height()) / 2);
+    if (simplified != NULL) {
+      delete isochrone.release();
+      isochrone.reset(simplified);
+    } else {
+      cerr << "Failed to simplify polygon" << endl;
+    }
+    if (stats != NULL) {
+      stats->add_counter("vertices_after_simplify", polygon_vertex_count((const OGRPolygon&) *isochrone));
+    }
+
+    if (options._verbose) {
+      cerr << "Generated polygon with " << ((OGRPolygon *)isochrone.get())->getNumInteriorRings() << " interior rings" << endl;
+    }
+  }
+
+  return isochrones;
 }
 
-static void
-checkNotClosed(const coords_list_t& l) {
-  if (coordsEqual(l.front(), l.back())) {
-    cerr << "WARN: attempting to manipulate already closed loop" << endl;
+// Computes the population covered within every level of the request, summing
+// the population pixels whose centre falls on a pixel of the cost surface
+// reached within the level. Both rasters must share the coordinate system.
+static vector<double>
+compute_population(const raster_source_t& frictionSource,
+                   const raster_source_t& populationSource,
+                   const coverage_request_t& request,
+                   const run_options_t& options,
+                   unsigned threads,
+                   run_stats_t *stats = NULL)
+{
+  const raster_t& frictionRaster = frictionSource.raster();
+  const raster_t& populationRaster = populationSource.raster();
+  const cost_surface_t surface = compute_cost_surface(frictionSource, request, options, threads, stats);
+
+  const raster_window_t window =
+    populationRaster.window_covering(frictionRaster.top_left_coords(surface._window),
+                                     frictionRaster.bottom_right_coords(surface._window));
+  if (options._verbose) {
+    cerr << "Using population window " << window << endl;
   }
+
+  const vector<float> levels(request._levels.begin(), request._levels.end());
+  if (window.empty()) {
+    return vector<double>(levels.size(), 0.0);
+  }
+
+  double costTransform[6], populationTransform[6];
+  frictionRaster.window_geo_transform(surface._window, costTransform);
+  populationRaster.window_geo_transform(window, populationTransform);
+  phase_timer_t loadTimer(stats, "load_population");
+  unique_ptr<float[]> population = populationSource.load(window);
+  loadTimer.stop();
+
+  phase_timer_t timer(stats, "population");
+  return population_under_costs(surface._cost.get(), surface._window._width, surface._window._height, costTransform,
+                                population.get(), window._width, window._height, populationTransform,
+                                populationSource.no_data(), levels);
 }
 
-struct contour_builder_t {
-  list<coords_list_t> _sequences;
-  int _segments = 0;
-
-  void add_segment(const coords_t& a, const coords_t& b) {
-    list<coords_list_t>::iterator itSeqA = _sequences.end();
-    list<coords_list_t>::iterator itSeqB = _sequences.end();
-    bool prependA(false), prependB(false);
-
-    _segments++;
-    for (auto seqIt = _sequences.begin(); seqIt != _sequences.end(); seqIt++) {
-      if (itSeqA == _sequences.end()) {
-        if (coordsEqual(a, seqIt->front())) {
-          itSeqA = seqIt;
-          prependA = true;
-        } else if (coordsEqual(a, seqIt->back())) {
-          itSeqA = seqIt;
-          prependA = false;
-        }
-      }
-      if (itSeqB == _sequences.end()) {
-        if (coordsEqual(b, seqIt->front())) {
-          itSeqB = seqIt;
-          prependB = true;
-        } else if (coordsEqual(b, seqIt->back())) {
-          itSeqB = seqIt;
-          prependB = false;
-        }
-      }
-      if (itSeqA != _sequences.end() && itSeqB != _sequences.end()) {
-        break;
-      }
+static string
+geometry_wkt(const OGRGeometry& geometry)
+{
+  char *wkt = nullptr;
+  geometry.exportToWkt(&wkt);
+  string result(wkt);
+  CPLFree(wkt);
+  return result;
+}
+
+// Formats the isochrones of every level either as one WKT line per level, each
+// prefixed with `prefix`, or as a single line with a GeoJSON FeatureCollection
+// whose features have the level in their `time` property.
+static string
+format_isochrones(const vector<int>& levels,
+                  const vector<unique_ptr<OGRGeometry>>& isochrones,
+                  output_format_t format,
+                  const string& prefix = "")
+{
+  ostringstream out;
+  if (format == FORMAT_GEOJSON) {
+    out << prefix << "{\"type\":\"FeatureCollection\",\"features\":[";
+    for (size_t i = 0; i < isochrones.size(); ++i) {
+      char *json = isochrones[i]->exportToJson();
+      out << (i ? "," : "")
+          << "{\"type\":\"Feature\",\"properties\":{\"time\":" << levels[i] << "},"
+          << "\"geometry\":" << json << "}";
+      CPLFree(json);
     }
-    if (itSeqA != _sequences.end()) {
-      checkNotClosed(*itSeqA);
-    }
-    if (itSeqB != _sequences.end()) {
-      checkNotClosed(*itSeqB);
-    }
-
-    int c = (itSeqA != _sequences.end() ? 1 : 0) | (itSeqB != _sequences.end() ? 2 : 0);
-    switch (c) {
-    case 0:
-      // new sequence
-      itSeqA = _sequences.emplace(itSeqA);
-      itSeqA->push_back(a);
-      itSeqA->push_back(b);
-      break;
-    case 1:
-      // extend sequence *itSeqA with b
-      if (prependA) {
-        itSeqA->push_front(b);
-      } else {
-        itSeqA->push_back(b);
-      }
-      break;
-    case 2:
-      // extend sequence *itSeqB with a
-      if (prependB) {
-        itSeqB->push_front(a);
-      } else {
-        itSeqB->push_back(a);
-      }
-      break;
-    case 3:
-      // join sequences *itSeqA and *itSeqB
-      if (itSeqA == itSeqB) {
-        // close the loop
-        itSeqA->push_back(itSeqA->front());
-      } else {
-        if (prependA) {
-          if (prependB) itSeqB->reverse();
-          itSeqA->splice(itSeqA->begin(), *itSeqB);
-        } else {
-          if (!prependB) itSeqB->reverse();
-          itSeqA->splice(itSeqA->end(), *itSeqB);
-        }
-        _sequences.erase(itSeqB);
-      }
-      break;
+    out << "]}";
+  } else {
+    for (size_t i = 0; i < isochrones.size(); ++i) {
+      out << (i ? "\n" : "") << prefix << geometry_wkt(*isochrones[i]);
     }
   }
+  return out.str();
+}
 
-  OGRGeometry *build() {
-    OGRPolygon *result = new OGRPolygon();
-    OGRLinearRing **rings = new OGRLinearRing*[_sequences.size()];
-    int j = 0;
-    int outerRing = -1;
-    int outerRingPoints = -1;
-    for (auto seq : _sequences) {
-      OGRLinearRing *ring = rings[j] = new OGRLinearRing();
-      for (auto point : seq) {
-        ring->addPoint(point.first, point.second);
+
+// Formats the population covered within every level either as one line per
+// level, each prefixed with `prefix`, or as a single line with a JSON array of
+// objects with the level in their `time` property.
+static string
+format_population(const vector<int>& levels,
+                  const vector<double>& population,
+                  output_format_t format,
+                  const string& prefix = "")
+{
+  ostringstream out;
+  out << fixed << setprecision(0);
+  if (format == FORMAT_GEOJSON) {
+    out << prefix << "[";
+    for (size_t i = 0; i < population.size(); ++i) {
+      out << (i ? "," : "") << "{\"time\":" << levels[i] << ",\"population\":" << population[i] << "}";
+    }
+    out << "]";
+  } else {
+    for (size_t i = 0; i < population.size(); ++i) {
+      out << (i ? "\n" : "") << prefix << population[i];
+    }
+  }
+  return out.str();
+}
+
+
+// Computes the isochrones of the request, or the population covered if a
+// population raster is given, formatted for output with `prefix`.
+static string
+compute_coverage(const raster_source_t& frictionSource,
+                 const raster_source_t *populationSource,
+                 const coverage_request_t& request,
+                 const run_options_t& options,
+                 unsigned threads,
+                 const string& prefix = "",
+                 run_stats_t *stats = NULL)
+{
+  if (populationSource != NULL) {
+    vector<double> covered = compute_population(frictionSource, *populationSource, request, options, threads, stats);
+    phase_timer_t timer(stats, "export");
+    return format_population(request._levels, covered, options._format, prefix);
+  }
+  vector<unique_ptr<OGRGeometry>> isochrones = compute_isochrones(frictionSource, request, options, threads, stats);
+  phase_timer_t timer(stats, "export");
+  return format_isochrones(request._levels, isochrones, options._format, prefix);
+}
+
+
+// ======== Request serving mode
+
+template<typename T> static vector<T>
+json_values(const boost::property_tree::ptree& node)
+{
+  vector<T> values;
+  if (node.empty()) {
+    values.push_back(node.get_value<T>());
+  } else {
+    for (auto& child : node) {
+      values.push_back(child.second.get_value<T>());
+    }
+  }
+  return values;
+}
+
+static coverage_request_t
+parse_json_request(const string& line, string& rasterPath, const coverage_request_t& defaults)
+{
+  namespace pt = boost::property_tree;
+
+  pt::ptree json;
+  istringstream input(line);
+  pt::read_json(input, json);
+
+  // keys not given keep the values of the command line
+  coverage_request_t request(defaults);
+  rasterPath = json.get<string>("raster", rasterPath);
+
+  const pt::ptree& origin = json.get_child("origin");
+  if (origin.empty()) {
+    request._origin = parse_coordinates(origin.get_value<string>());
+  } else {
+    vector<double> lnglat = json_values<double>(origin);
+    if (lnglat.size() != 2) {
+      throw runtime_error("invalid origin coordinates");
+    }
+    request._origin = make_coords(lnglat[0], lnglat[1]);
+  }
+
+  if (json.count("max-time")) {
+    request._maxTimeCost = json_values<int>(json.get_child("max-time"));
+    // the levels default to the max-time of the request itself
+    request._levels.clear();
+  }
+  if (json.count("min-friction")) {
+    request._minFriction = json_values<float>(json.get_child("min-friction"));
+  }
+  // every request writes its own cost raster, if any
+  request._outputCostPath = json.get<string>("output-cost-raster", "");
+  request._populationPath = json.get<string>("population-raster", defaults._populationPath);
+  if (json.count("engine")) {
+    request._engine = parse_engine(json.get<string>("engine"));
+  }
+
+  if (json.count("levels")) {
+    request._levels.clear();
+    for (double level : json_values<double>(json.get_child("levels"))) {
+      request._levels.push_back(level_minutes(level));
+    }
+  }
+
+  check_request(request);
+  return request;
+}
+
+// Reads one JSON request per line and writes the coverage (or the population
+// covered) for each one (one line per level, or a single one for GeoJSON) or an
+// ERROR line. Decoded friction and population rasters are kept between requests, so only the first request on every
+// raster pays for opening and reading it.
+static void
+serve_requests(istream& in, ostream& out, const run_options_t& options)
+{
+  raster_cache_t cache(options._cacheSize);
+
+  string line;
+  while (getline(in, line)) {
+    if (line.find_first_not_of(" \t\r") == string::npos) continue;
+
+    try {
+      string rasterPath = options._rasterPath;
+      coverage_request_t request = parse_json_request(line, rasterPath, options._request);
+      if (rasterPath.empty()) {
+        throw runtime_error("missing friction raster");
       }
-      // this removes some extraneous artifacts from the contour algorithm which
-      // can later produce problems with PostGIS; a closed polygon *must* consist
-      // of at least 4 points
-      ring->closeRings();
-      if (ring->getNumPoints() < 4) {
-        delete ring;
-        continue;
+      if (options._verbose) {
+        cerr << "Using friction raster file: " << rasterPath << endl;
       }
-      if (ring->getNumPoints() > outerRingPoints) {
-        outerRing = j;
-        outerRingPoints = ring->getNumPoints();
+
+      run_stats_t stats;
+      run_stats_t *pStats = options._stats ? &stats : NULL;
+
+      // opening a raster not cached yet includes decoding it
+      phase_timer_t openTimer(pStats, "open");
+      shared_ptr<const raster_source_t> friction = cache.get(rasterPath);
+      shared_ptr<const raster_source_t> population;
+      if (!request._populationPath.empty()) {
+        population = cache.get(request._populationPath);
       }
-      j++;
-    }
+      openTimer.stop();
 
-    // use the ring with the greatest number of points as the outer ring
-    if (outerRing >= 0) {
-      result->addRing(rings[outerRing]);
-      for (int i = 0; i < j; i++) {
-        if (i == outerRing) continue;
-        result->addRing(rings[i]);
+      out << compute_coverage(*friction, population.get(), request, options, thread_count(options._threads), "", pStats) << endl;
+      if (pStats != NULL) {
+        cerr << stats.to_json() << endl;
       }
+    } catch (exception& e) {
+      out << "ERROR: " << e.what() << endl;
     }
-
-    delete[] rings;
-    return result;
   }
-};
+}
+
 
-static unique_ptr<OGRGeometry>
-extract_isochrone(const float *data, int width, int height, const coords_t& topLeft, const coords_t& bottomRight, float time)
+// ======== Batch mode
+
+// Reads origins from a GeoJSON FeatureCollection of points, or from a CSV
+// file with id,lng,lat (or just lng,lat) lines and an optional header.
+static vector<labelled_origin_t>
+read_origins(const string& path)
 {
-#ifdef BENCHMARK
-  boost::timer::auto_cpu_timer t(std::cerr, 6, "extract_isochrone: %t sec CPU, %w sec real\n");
-#endif
-
-  unique_ptr<const float *[]> dataRows(new const float *[height]);
-  const float *p = data;
-  for (int i = 0; i < height; i++, p += width) {
-    dataRows[i] = p;
-  }
-  unique_ptr<double[]> latitudes(new double[height]);
-  unique_ptr<double[]> longitudes(new double[width]);
-  double dLat = (bottomRight.second - topLeft.second) / height;
-  double lat = topLeft.second + dLat / 2;
-  for (int i = 0; i < height; i++, lat += dLat) {
-    latitudes[i] = lat;
-  }
-  double dLng = (bottomRight.first - topLeft.first) / width;
-  double lng = topLeft.first + dLng / 2;
-  for (int i = 0; i < width; i++, lng += dLng) {
-    longitudes[i] = lng;
-  }
-  float times[] = { time };
-
-  contour_builder_t builder;
-  auto callback = [&builder](double x1, double y1, double x2, double y2, float z) {
-    builder.add_segment(make_coords(y1, x1), make_coords(y2, x2));
-  };
+  namespace pt = boost::property_tree;
 
-  conrec(dataRows.get(),
-         0, height - 1, 0, width - 1,
-         latitudes.get(), longitudes.get(),
-         1, times,
-         callback);
+  ifstream input(path);
+  if (!input) {
+    throw runtime_error("cannot open origins file '" + path + "'");
+  }
 
-  OGRGeometry *polygon = builder.build();
-  return unique_ptr<OGRGeometry>(polygon);
-}
+  vector<labelled_origin_t> origins;
+  input >> ws;
+
+  if (input.peek() == '{') {
+    pt::ptree json;
+    pt::read_json(input, json);
+    for (auto& child : json.get_child("features")) {
+      const pt::ptree& feature = child.second;
+      vector<double> lnglat = json_values<double>(feature.get_child("geometry.coordinates"));
+      if (lnglat.size() < 2) {
+        throw runtime_error("invalid point coordinates in origins file");
+      }
+      string id = feature.get<string>("id", feature.get<string>("properties.id", to_string(origins.size() + 1)));
+      labelled_origin_t origin = { id, make_coords(lnglat[0], lnglat[1]) };
+      origins.push_back(origin);
+    }
+    return origins;
+  }
+
+  string line;
+  for (int lineNumber = 1; getline(input, line); ++lineNumber) {
+    boost::trim(line);
+    if (line.empty()) continue;
 
+    vector<string> fields;
+    boost::split(fields, line, [](char c) { return c == ','; });
+    for (auto& field : fields) boost::trim(field);
+    if (fields.size() != 2 && fields.size() != 3) {
+      throw runtime_error("invalid line " + to_string(lineNumber) + " in origins file");
+    }
 
+    const size_t lngField = fields.size() - 2;
+    labelled_origin_t origin;
+    try {
+      origin._coords = make_coords(parse_double(fields[lngField]), parse_double(fields[lngField + 1]));
+    } catch (runtime_error&) {
+      if (lineNumber == 1) continue; // header
+      throw;
+    }
+    origin._id = fields.size() == 3 ? fields[0] : to_string(origins.size() + 1);
+    origins.push_back(origin);
+  }
+  return origins;
+}
+
+// Computes the coverage (or the population covered, when a population raster
+// is given) of every origin in parallel from a single read of the rasters, and
+// writes an "id<TAB>result" line for every origin in input order as soon as it
+// and all of the previous ones are done. With --stats, the statistics of every
+// origin are written as it is done, and the reading of the rasters is added
+// to `stats`.
 static void
-merge_cost_layer(float base[], const float layer[], int width, int height, float baseCost, float layerCost)
+run_batch(raster_source_t& friction,
+          raster_source_t *population,
+          const vector<labelled_origin_t>& origins,
+          const run_options_t& options,
+          ostream& out,
+          run_stats_t *stats = NULL)
 {
-  const int size = width * height;
-  for (int i=0; i<size; ++i) {
-    base[i] = min(base[i], baseCost * layer[i] / layerCost);
+  const raster_t& raster = friction.raster();
+  phase_timer_t decodeTimer(stats, "load");
+
+  // decode the union of the windows that the searches will need once
+  raster_window_t window = { 0, 0, 0, 0 };
+  for (auto& origin : origins) {
+    if (!raster.contains(origin._coords)) continue;
+    window = window.merge(reachable_window(raster, raster.pixel_coords(origin._coords),
+                                           search_budgets(options._request),
+                                           options._request._minFriction));
+  }
+  if (!window.empty()) {
+    friction.decode(window);
+  }
+  if (options._verbose) {
+    cerr << "Decoded friction window " << window << " for " << origins.size() << " origins" << endl;
   }
+  if (population != NULL && !window.empty()) {
+    const raster_window_t populationWindow =
+      population->raster().window_covering(raster.top_left_coords(window), raster.bottom_right_coords(window));
+    if (!populationWindow.empty()) {
+      population->decode(populationWindow);
+    }
+    if (options._verbose) {
+      cerr << "Decoded population window " << populationWindow << endl;
+    }
+  }
+
+  decodeTimer.stop();
+  if (stats != NULL) {
+    stats->add_counter("pixels_loaded", (double) window._width * window._height);
+  }
+
+  // the searches only read the decoded windows, which are safe to share
+  friction.set_decoded_only(true);
+  if (population != NULL) {
+    population->set_decoded_only(true);
+  }
+  const raster_source_t& source = friction;
+  vector<string> results(origins.size());
+  vector<bool> done(origins.size(), false);
+  size_t written = 0;
+  mutex outputMutex;
+
+  parallel_for(origins.size(), thread_count(options._threads), [&](size_t i) {
+    coverage_request_t request(options._request);
+    request._origin = origins[i]._coords;
+
+    // origins already run in parallel, so each one is computed on one thread
+    const string prefix = origins[i]._id + "\t";
+    string result;
+    run_stats_t stats;
+    try {
+      result = compute_coverage(source, population, request, options, 1, prefix, options._stats ? &stats : NULL);
+    } catch (exception& e) {
+      result = prefix + "ERROR: " + e.what();
+    }
+
+    lock_guard<mutex> lock(outputMutex);
+    if (options._stats) {
+      cerr << stats.to_json("\"id\":\"" + origins[i]._id + "\",") << endl;
+    }
+    results[i] = result;
+    done[i] = true;
+    while (written < origins.size() && done[written]) {
+      out << results[written] << endl;
+      results[written].clear();
+      written++;
+    }
+  });
 }
 
+
 // ======== Main entry point
 
 // program exit codes
@@ -951,7 +1689,7 @@ int main(int argc, char *argv[])
   if (!parse_command_line(argc, argv, options)) {
     return ERROR_IN_COMMAND_LINE;
   }
-  if (options._rasterPath.empty()) {
+  if (options._rasterPath.empty() && !options._serve) {
     // eg. if help was requested
     return SUCCESS;
   }
@@ -959,93 +1697,61 @@ int main(int argc, char *argv[])
   GDALAllRegister();
   OGRRegisterAll();
 
-  GDALDataset *poDataset;
-
-  poDataset = (GDALDataset *) GDALOpen(options._rasterPath.c_str(), GA_ReadOnly);
-  if (poDataset == NULL) {
-    return ERROR_OTHER;
-  }
-
-  raster_t frictionRaster(poDataset);
-  if (!frictionRaster.is_north_up()) {
-    cerr << "ERROR: raster must be normalized 'north-up'" << endl;
-    return ERROR_OTHER;
-  }
+  try {
+    if (options._serve) {
+      serve_requests(cin, cout, options);
+      return SUCCESS;
+    }
 
-  if (options._verbose) {
-    cerr << "Using friction raster file: " << options._rasterPath << endl;
+    run_stats_t stats;
+    run_stats_t *pStats = options._stats ? &stats : NULL;
 
-    show_raster_info(frictionRaster, cerr);
+    phase_timer_t openTimer(pStats, "open");
+    raster_source_t friction(options._rasterPath);
 
-    cerr << "Using origin at " << options._origin << endl;
-  }
+    if (options._verbose) {
+      cerr << "Using friction raster file: " << options._rasterPath << endl;
 
-  if (!frictionRaster.contains(options._origin)) {
-    cerr << "ERROR: origin out of raster boundaries" << endl;
-    return ERROR_OTHER;
-  }
+      show_raster_info(friction.raster(), cerr);
+    }
 
-  pixel_coords_t pixelOrigin(frictionRaster.pixel_coords(options._origin));
-  if (options._verbose) {
-    cerr << "Pixel origin at " << pixelOrigin << endl;
-  }
-
-  int width, height;
-  float nodata;
-  unique_ptr<float[]> friction = load_friction_data(frictionRaster.dataset(), 1, &width, &height, &nodata);
-
-  const int maxTimeCost = options._maxTimeCost[0]; // minutes
-
-  unique_ptr<float[]> cost =
-    run_dijkstra_on_friction_layer(friction.get(),
-                                   width, height, nodata,
-                                   frictionRaster.pixel_width_meters(),
-                                   frictionRaster.pixel_height_meters(),
-                                   pixelOrigin.first, pixelOrigin.second,
-                                   maxTimeCost,
-                                   options._minFriction[0]);
-
-  for (size_t i = 1; i < options._maxTimeCost.size(); ++i) {
-    unique_ptr<float[]> new_cost =
-      run_dijkstra_on_friction_layer(friction.get(),
-                                     width, height, nodata,
-                                     frictionRaster.pixel_width_meters(),
-                                     frictionRaster.pixel_height_meters(),
-                                     pixelOrigin.first, pixelOrigin.second,
-                                     options._maxTimeCost[i],
-                                     options._minFriction[i]);
+    unique_ptr<raster_source_t> population;
+    if (!options._request._populationPath.empty()) {
+      population.reset(new raster_source_t(options._request._populationPath));
+    }
+    openTimer.stop();
 
-    // To calculate the isochrone at `maxTimeCost` level
-    // the layer `new_cost` has to be scaled before merging
-    // with the previously calculated layer `cost`
-    merge_cost_layer(cost.get(), new_cost.get(), width, height, maxTimeCost, options._maxTimeCost[i]);
-  }
+    vector<labelled_origin_t> origins(options._origins);
+    if (!options._originsPath.empty()) {
+      vector<labelled_origin_t> fileOrigins = read_origins(options._originsPath);
+      origins.insert(origins.end(), fileOrigins.begin(), fileOrigins.end());
+    }
 
-  if (!options._outputCostPath.empty()) {
-    write_cost_layer(options._outputCostPath, frictionRaster.dataset(), cost.get(), width, height);
-    if (options._verbose) {
-      cerr << "Wrote " << options._outputCostPath << endl;
+    if (options.batch()) {
+      run_batch(friction, population.get(), origins, options, cout, pStats);
+      if (pStats != NULL) {
+        cerr << stats.to_json("\"origins\":" + to_string(origins.size()) + ",") << endl;
+      }
+      return SUCCESS;
     }
-  }
 
-  // print the coverage WKT
-  unique_ptr<OGRGeometry> isochrone = extract_isochrone(cost.get(), width, height, frictionRaster.top_left_coords(), frictionRaster.bottom_right_coords(), maxTimeCost);
-  char *wkt = nullptr;
+    coverage_request_t request(options._request);
+    if (options._nearest) {
+      for (auto& origin : origins) {
+        request._origins.push_back(origin._coords);
+      }
+    }
 
-  OGRGeometry *simplified = isochrone->SimplifyPreserveTopology(min(frictionRaster.pixel_width(), frictionRaster.pixel_height()) / 2);
-  if (simplified != NULL) {
-    delete isochrone.release();
-    isochrone.reset(simplified);
-  } else {
-    cerr << "Failed to simplify polygon" << endl;
-  }
+    // print the coverage WKT (or the population covered)
+    cout << compute_coverage(friction, population.get(), request, options, thread_count(options._threads), "", pStats) << endl;
+    if (pStats != NULL) {
+      cerr << stats.to_json() << endl;
+    }
 
-  if (options._verbose) {
-    cerr << "Generated polygon with " << ((OGRPolygon *)isochrone.get())->getNumInteriorRings() << " interior rings" << endl;
+  } catch (exception& e) {
+    cerr << "ERROR: " << e.what() << endl;
+    return ERROR_OTHER;
   }
-  isochrone->exportToWkt(&wkt);
-  cout << wkt << endl;
-  CPLFree(wkt);
 
   return SUCCESS;
 }
@@ -0,0 +1,3270 @@
+// Raster search and contouring kernels shared by walking-coverage and its
+// benchmark.
+
+#ifndef WALKING_COVERAGE_H
+#define WALKING_COVERAGE_H
+
+#include "boost/heap/binomial_heap.hpp"
+#include "boost/timer/timer.hpp"
+
+#include "gdal_priv.h"
+#include "cpl_conv.h"
+#include "ogr_geometry.h"
+
+#include <iostream>
+#include <string>
+#include <stdexcept>
+#include <vector>
+#include <list>
+#include <functional>
+#include <limits>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <set>
+#include <sstream>
+#include <iomanip>
+
+#include <chrono>
+#include <ctime>
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+// ====== Generic utilities
+
+template<typename T> inline bool
+between(const T& value, const T& x1, const T& x2)
+{
+  if (x1 > x2) {
+    return value >= x2 && value <= x1;
+  } else {
+    return value >= x1 && value <= x2;
+  }
+}
+
+
+
+// ===== Parallel execution
+
+inline unsigned
+thread_count(unsigned requested)
+{
+  if (requested > 0) return requested;
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Runs task(i) for every i in [0, count) on up to `threads` threads, handing
+// out the indices in increasing order. Returns when all tasks are done.
+inline void
+parallel_for(size_t count, unsigned threads, const std::function<void(size_t)>& task)
+{
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    for (size_t i = next++; i < count; i = next++) {
+      task(i);
+    }
+  };
+
+  std::vector<std::thread> pool;
+  for (unsigned i = 1; i < std::min<size_t>(threads, count); ++i) {
+    pool.emplace_back(worker);
+  }
+  worker();
+  for (auto& t : pool) {
+    t.join();
+  }
+}
+
+
+// ===== Run statistics
+
+// Wall and CPU time of the phases of a computation, and counters of the work
+// done in them, written as a JSON object. Phases and counters recorded more
+// than once add up, and are listed in the order they were first recorded;
+// they can be recorded from several threads. CPU time is that of the whole
+// process, so it includes any work running concurrently with the phase.
+class run_stats_t {
+  struct phase_t {
+    std::string _name;
+    double _wall;
+    double _cpu;
+  };
+
+  std::vector<phase_t> _phases;
+  std::vector<std::pair<std::string, double>> _counters;
+  mutable std::mutex _mutex;
+
+public:
+  void add_phase(const std::string& name, double wall, double cpu) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (auto& phase : _phases) {
+      if (phase._name == name) {
+        phase._wall += wall;
+        phase._cpu += cpu;
+        return;
+      }
+    }
+    _phases.push_back(phase_t { name, wall, cpu });
+  }
+
+  void add_counter(const std::string& name, double value) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (auto& counter : _counters) {
+      if (counter.first == name) {
+        counter.second += value;
+        return;
+      }
+    }
+    _counters.push_back(std::make_pair(name, value));
+  }
+
+  // `fields` are written first as they are, eg. "\"id\":\"1\","
+  std::string to_json(const std::string& fields = "") const {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::ostringstream out;
+    out << "{" << fields << "\"phases\":{";
+    for (size_t i = 0; i < _phases.size(); ++i) {
+      out << (i ? "," : "") << "\"" << _phases[i]._name << "\":{" << std::fixed << std::setprecision(6)
+          << "\"wall\":" << _phases[i]._wall << ",\"cpu\":" << _phases[i]._cpu << "}";
+    }
+    out << "},\"counters\":{" << std::setprecision(0);
+    for (size_t i = 0; i < _counters.size(); ++i) {
+      out << (i ? "," : "") << "\"" << _counters[i].first << "\":" << _counters[i].second;
+    }
+    // ru_maxrss is in kilobytes on Linux
+    out << "},\"peak_rss_kb\":" << usage.ru_maxrss << "}";
+    return out.str();
+  }
+};
+
+// Records the time from its construction to its destruction (or to stop())
+// as a phase of the statistics, if any are given. The process CPU clock is
+// used rather than boost::timer, whose CPU times have the resolution of
+// the scheduler tick.
+class phase_timer_t {
+  run_stats_t *_stats;
+  std::string _name;
+  std::chrono::steady_clock::time_point _wallStart;
+  double _cpuStart;
+
+  static double cpu_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+  }
+
+public:
+  phase_timer_t(run_stats_t *stats, const std::string& name) : _stats(stats), _name(name) {
+    if (_stats != NULL) {
+      _wallStart = std::chrono::steady_clock::now();
+      _cpuStart = cpu_seconds();
+    }
+  }
+  ~phase_timer_t() { stop(); }
+
+  void stop() {
+    if (_stats != NULL) {
+      const std::chrono::duration<double> wall = std::chrono::steady_clock::now() - _wallStart;
+      _stats->add_phase(_name, wall.count(), cpu_seconds() - _cpuStart);
+      _stats = NULL;
+    }
+  }
+};
+
+
+// ===== Coordinates
+
+typedef std::pair<double,double> coords_t;
+typedef std::list<coords_t> coords_list_t;
+
+inline coords_t
+make_coords(double lng, double lat)
+{
+  return std::make_pair(lng, lat);
+}
+
+typedef std::pair<int,int> pixel_coords_t;
+
+inline pixel_coords_t
+make_pixel_coords(int x, int y)
+{
+  return std::make_pair(x, y);
+}
+
+template<typename T>
+std::ostream& operator<<(std::ostream& os, const std::pair<T,T>& p) {
+  os << p.first << "," << p.second;
+  return os;
+}
+
+
+// ===== Raster window
+
+// Rectangular region of a raster given in pixel coordinates
+struct raster_window_t {
+  int _xOff;
+  int _yOff;
+  int _width;
+  int _height;
+
+  bool contains(const pixel_coords_t& pixel) const {
+    return pixel.first >= _xOff && pixel.first < _xOff + _width
+      && pixel.second >= _yOff && pixel.second < _yOff + _height;
+  }
+  bool contains(const raster_window_t& other) const {
+    return other._xOff >= _xOff && other._xOff + other._width <= _xOff + _width
+      && other._yOff >= _yOff && other._yOff + other._height <= _yOff + _height;
+  }
+  bool empty() const {
+    return _width <= 0 || _height <= 0;
+  }
+
+  // common part of both, empty if they do not overlap
+  raster_window_t intersect(const raster_window_t& other) const {
+    const int x1 = std::max(_xOff, other._xOff);
+    const int y1 = std::max(_yOff, other._yOff);
+    const int x2 = std::min(_xOff + _width, other._xOff + other._width);
+    const int y2 = std::min(_yOff + _height, other._yOff + other._height);
+    raster_window_t window = { x1, y1, std::max(0, x2 - x1), std::max(0, y2 - y1) };
+    return window;
+  }
+
+  // smallest window containing both
+  raster_window_t merge(const raster_window_t& other) const {
+    if (empty()) return other;
+    if (other.empty()) return *this;
+    const int x1 = std::min(_xOff, other._xOff);
+    const int y1 = std::min(_yOff, other._yOff);
+    const int x2 = std::max(_xOff + _width, other._xOff + other._width);
+    const int y2 = std::max(_yOff + _height, other._yOff + other._height);
+    raster_window_t window = { x1, y1, x2 - x1, y2 - y1 };
+    return window;
+  }
+};
+
+inline std::ostream& operator<<(std::ostream& os, const raster_window_t& w) {
+  os << w._width << "x" << w._height << "+" << w._xOff << "+" << w._yOff;
+  return os;
+}
+
+
+// ===== Raster adapter
+
+class raster_t {
+  GDALDataset *_dataset;  // NULL if the raster is not read through GDAL
+  double _geoTransform[6];
+  int _width, _height;
+  std::string _projection;
+
+public:
+  raster_t(GDALDataset *poDataset) : _dataset(poDataset) {
+    if (poDataset == NULL) {
+      throw std::invalid_argument("dataset cannot be NULL");
+    }
+    if (poDataset->GetGeoTransform(_geoTransform) != CE_None) {
+      throw std::invalid_argument("cannot get geotransform for raster");
+    }
+    _width = poDataset->GetRasterXSize();
+    _height = poDataset->GetRasterYSize();
+    const char *projection = poDataset->GetProjectionRef();
+    _projection = projection != NULL ? projection : "";
+  }
+  // single band raster described by its metadata alone
+  raster_t(int width, int height, const double geoTransform[6], const std::string& projection)
+    : _dataset(NULL), _width(width), _height(height), _projection(projection) {
+    std::copy(geoTransform, geoTransform + 6, _geoTransform);
+  }
+  virtual ~raster_t() {
+    if (_dataset != NULL) {
+      GDALClose(_dataset);
+    }
+  }
+
+  bool is_north_up() const {
+    return _geoTransform[2] == 0 && _geoTransform[4] == 0
+      && _geoTransform[1] > 0 && _geoTransform[5] < 0;
+  }
+  coords_t top_left_coords() const {
+    return make_coords(_geoTransform[0], _geoTransform[3]);
+  }
+  coords_t bottom_right_coords() const {
+    return make_coords(_geoTransform[0] + _geoTransform[1] * _width,
+                       _geoTransform[3] + _geoTransform[5] * _height);
+  }
+  int x_size() const { return _width; }
+  int y_size() const { return _height; }
+  int band_count() const { return _dataset != NULL ? _dataset->GetRasterCount() : 1; }
+  double pixel_width() const { return _geoTransform[1]; }
+  double pixel_height() const { return -_geoTransform[5]; }
+  const std::string& projection() const { return _projection; }
+  GDALDataset *dataset() const { return _dataset; }
+  GDALDriver *driver() const { return _dataset != NULL ? _dataset->GetDriver() : NULL; }
+  float pixel_width_meters() const {
+    float lngDegDistInMEquator = 111111.0f;
+    float centerLat = (top_left_coords().second + bottom_right_coords().second) / 2;
+    return lngDegDistInMEquator * std::cos(M_PI * centerLat / 180.0f) * pixel_width();
+  }
+  float pixel_height_meters() const {
+    float latDegDistInM = 111111.0f;
+    return latDegDistInM * pixel_height();
+  }
+
+  bool contains(const coords_t& point) const {
+    const coords_t tl(top_left_coords());
+    const coords_t br(bottom_right_coords());
+    return between(point.first, tl.first, br.first)
+      && between(point.second, tl.second, br.second);
+  }
+
+  pixel_coords_t pixel_coords(const coords_t& lnglat) const {
+    const coords_t tl(top_left_coords());
+
+    return make_pixel_coords((lnglat.first - tl.first) / pixel_width(),
+                             (lnglat.second - tl.second) / -pixel_height());
+  }
+
+  raster_window_t full_window() const {
+    raster_window_t window = { 0, 0, x_size(), y_size() };
+    return window;
+  }
+  // window of (2 * radius + 1) pixels side around center, clipped to the raster
+  raster_window_t window_around(const pixel_coords_t& center, int radiusX, int radiusY) const {
+    const int x1 = std::max(0, center.first - radiusX);
+    const int y1 = std::max(0, center.second - radiusY);
+    const int x2 = std::min(x_size(), center.first + radiusX + 1);
+    const int y2 = std::min(y_size(), center.second + radiusY + 1);
+    raster_window_t window = { x1, y1, std::max(0, x2 - x1), std::max(0, y2 - y1) };
+    return window;
+  }
+  // window of the pixels overlapping the extent, clipped to the raster
+  raster_window_t window_covering(const coords_t& topLeft, const coords_t& bottomRight) const {
+    const int x1 = std::max(0, (int) std::floor((topLeft.first - _geoTransform[0]) / _geoTransform[1]));
+    const int y1 = std::max(0, (int) std::floor((topLeft.second - _geoTransform[3]) / _geoTransform[5]));
+    const int x2 = std::min(x_size(), (int) std::ceil((bottomRight.first - _geoTransform[0]) / _geoTransform[1]));
+    const int y2 = std::min(y_size(), (int) std::ceil((bottomRight.second - _geoTransform[3]) / _geoTransform[5]));
+    raster_window_t window = { x1, y1, std::max(0, x2 - x1), std::max(0, y2 - y1) };
+    return window;
+  }
+  coords_t top_left_coords(const raster_window_t& window) const {
+    return make_coords(_geoTransform[0] + _geoTransform[1] * window._xOff,
+                       _geoTransform[3] + _geoTransform[5] * window._yOff);
+  }
+  coords_t bottom_right_coords(const raster_window_t& window) const {
+    return make_coords(_geoTransform[0] + _geoTransform[1] * (window._xOff + window._width),
+                       _geoTransform[3] + _geoTransform[5] * (window._yOff + window._height));
+  }
+  void window_geo_transform(const raster_window_t& window, double geoTransform[6]) const {
+    std::copy(_geoTransform, _geoTransform + 6, geoTransform);
+    geoTransform[0] += _geoTransform[1] * window._xOff + _geoTransform[2] * window._yOff;
+    geoTransform[3] += _geoTransform[4] * window._xOff + _geoTransform[5] * window._yOff;
+  }
+};
+
+
+
+// ===== Search and contour options
+
+enum queue_kind_t {
+  QUEUE_DARY,
+  QUEUE_BINOMIAL
+};
+
+enum layout_kind_t {
+  LAYOUT_ROW_MAJOR,
+  LAYOUT_TILED
+};
+
+enum search_state_kind_t {
+  STATE_DENSE,
+  STATE_SPARSE
+};
+
+enum search_engine_kind_t {
+  ENGINE_DIJKSTRA,
+  ENGINE_PARALLEL,
+  ENGINE_SWEEP
+};
+
+enum contour_kind_t {
+  CONTOUR_CONREC,
+  CONTOUR_MARCHING_SQUARES
+};
+
+
+// ======== Pixel layouts
+
+// Plain row-major order, the layout of the rasters themselves.
+struct row_major_layout_t {
+  int _width, _height;
+
+  row_major_layout_t(int width, int height) : _width(width), _height(height) {}
+
+  inline size_t size() const { return (size_t) _width * _height; }
+  inline int index(int x, int y) const { return x + _width * y; }
+  inline void coords(int index, int& x, int& y) const {
+    x = index % _width;
+    y = index / _width;
+  }
+};
+
+// Pixels grouped in TILE x TILE blocks, row-major within every block and
+// blocks stored row-major. The 8 neighbours of a pixel are then within the
+// same block (or an adjacent one) regardless of the raster width, instead of
+// three raster rows apart. Rasters are padded to a whole number of tiles.
+struct tiled_layout_t {
+  enum {
+    TILE_BITS = 6,
+    TILE = 1 << TILE_BITS,
+    TILE_MASK = TILE - 1
+  };
+
+  int _width, _height;
+  int _tilesX, _tilesY;
+
+  tiled_layout_t(int width, int height)
+    : _width(width), _height(height),
+      _tilesX((width + TILE - 1) / TILE), _tilesY((height + TILE - 1) / TILE) {}
+
+  inline size_t size() const { return (size_t) _tilesX * _tilesY * TILE * TILE; }
+  inline int index(int x, int y) const {
+    const int tile = (y >> TILE_BITS) * _tilesX + (x >> TILE_BITS);
+    return (tile << (2 * TILE_BITS)) | ((y & TILE_MASK) << TILE_BITS) | (x & TILE_MASK);
+  }
+  inline void coords(int index, int& x, int& y) const {
+    const int tile = index >> (2 * TILE_BITS);
+    x = ((tile % _tilesX) << TILE_BITS) | (index & TILE_MASK);
+    y = ((tile / _tilesX) << TILE_BITS) | ((index >> TILE_BITS) & TILE_MASK);
+  }
+
+  // copies a row-major raster into this layout, filling the padding
+  template<typename T>
+  void from_row_major(const T* src, T* dst, T padding) const {
+    std::fill(dst, dst + size(), padding);
+    for (int y = 0; y < _height; ++y) {
+      const T* row = src + (size_t) y * _width;
+      for (int x0 = 0; x0 < _width; x0 += TILE) {
+        const int count = std::min<int>(TILE, _width - x0);
+        std::copy(row + x0, row + x0 + count, dst + index(x0, y));
+      }
+    }
+  }
+
+  template<typename T>
+  void to_row_major(const T* src, T* dst) const {
+    for (int y = 0; y < _height; ++y) {
+      T* row = dst + (size_t) y * _width;
+      for (int x0 = 0; x0 < _width; x0 += TILE) {
+        const int count = std::min<int>(TILE, _width - x0);
+        const T* block = src + index(x0, y);
+        std::copy(block, block + count, row + x0);
+      }
+    }
+  }
+};
+
+
+// ======== Search state
+
+// Per pixel state of a search (costs, heap positions) indexed as the pixel
+// layout. Both grids are read with get() and written through [].
+
+// Every pixel allocated and initialized up front.
+template<typename T>
+class dense_grid_t {
+  std::unique_ptr<T[]> _data;
+
+public:
+  dense_grid_t(size_t size, T value) : _data(new T[size]) {
+    std::fill(&_data[0], &_data[size], value);
+  }
+
+  inline T get(int index) const { return _data[index]; }
+  inline T& operator[](int index) { return _data[index]; }
+
+  inline T* data() { return _data.get(); }
+  inline std::unique_ptr<T[]> release() { return std::move(_data); }
+};
+
+// Pixels allocated in blocks of one tile (of the tiled layout) the first time
+// a pixel in the block is written; pixels in unallocated blocks read as the
+// initial value. Memory and initialization time are then proportional to the
+// area the search reaches rather than to the raster window.
+template<typename T>
+class sparse_grid_t {
+public:
+  enum {
+    BLOCK_BITS = 2 * tiled_layout_t::TILE_BITS,
+    BLOCK = 1 << BLOCK_BITS,
+    BLOCK_MASK = BLOCK - 1
+  };
+
+private:
+  std::vector<std::unique_ptr<T[]>> _blocks;
+  T _value;
+
+public:
+  sparse_grid_t(size_t size, T value) : _blocks((size + BLOCK - 1) >> BLOCK_BITS), _value(value) {}
+
+  inline T get(int index) const {
+    const T* block = _blocks[index >> BLOCK_BITS].get();
+    return block ? block[index & BLOCK_MASK] : _value;
+  }
+  inline T& operator[](int index) {
+    std::unique_ptr<T[]>& block = _blocks[index >> BLOCK_BITS];
+    if (!block) {
+      block.reset(new T[BLOCK]);
+      std::fill(&block[0], &block[BLOCK], _value);
+    }
+    return block[index & BLOCK_MASK];
+  }
+
+  inline T value() const { return _value; }
+  inline size_t block_count() const { return _blocks.size(); }
+  inline const T* block(size_t i) const { return _blocks[i].get(); }
+  inline T* block(size_t i) { return _blocks[i].get(); }
+  inline void allocate(size_t i) { (*this)[i << BLOCK_BITS]; }
+};
+
+
+// ======== Priority queues
+
+struct queue_entry_t {
+  float _cost;
+  int   _index;
+
+  inline explicit queue_entry_t(float cost = 0, int index = -1) : _cost(cost), _index(index) {}
+
+  inline bool operator<(const queue_entry_t& other) const {
+    // we want the least costly element at the top of the priority queue
+    return other._cost < _cost;
+  }
+};
+
+// Node based queue, kept around to benchmark against the indexed heap; a
+// handle is kept for every pixel to support the decrease-key operation.
+template<template<typename> class grid_t>
+class binomial_queue_t {
+  typedef typename boost::heap::binomial_heap<queue_entry_t> heap_t;
+  typedef typename heap_t::handle_type handle_t;
+
+  heap_t _heap;
+  grid_t<handle_t> _handles;
+
+public:
+  explicit binomial_queue_t(size_t size) : _handles(size, handle_t()) {}
+
+  inline bool empty() const { return _heap.empty(); }
+
+  inline queue_entry_t pop() {
+    queue_entry_t top = _heap.top();
+    _heap.pop();
+    return top;
+  }
+
+  // returns whether the pixel was pushed rather than decreased
+  inline bool push_or_decrease(int index, float cost) {
+    handle_t handle = _handles.get(index);
+    if (handle == handle_t()) {
+      _handles[index] = _heap.push(queue_entry_t(cost, index));
+      return true;
+    }
+    _heap.update(handle, queue_entry_t(cost, index));
+    return false;
+  }
+};
+
+// Indexed D-ary min-heap. Entries are stored contiguously and the position
+// of every pixel in the heap is tracked in an int32 grid (-1 if the pixel is
+// not queued), so decrease-key is a sift-up in place.
+template<int D, template<typename> class grid_t>
+class indexed_dary_heap_t {
+  std::vector<queue_entry_t> _entries;
+  grid_t<int32_t> _positions;
+
+public:
+  explicit indexed_dary_heap_t(size_t size) : _positions(size, -1) {}
+
+  inline bool empty() const { return _entries.empty(); }
+  inline const queue_entry_t& top() const { return _entries.front(); }
+
+  inline queue_entry_t pop() {
+    queue_entry_t top = _entries.front();
+    _positions[top._index] = -1;
+    queue_entry_t last = _entries.back();
+    _entries.pop_back();
+    if (!_entries.empty()) {
+      sift_down(0, last);
+    }
+    return top;
+  }
+
+  // returns whether the pixel was pushed rather than decreased
+  inline bool push_or_decrease(int index, float cost) {
+    int32_t pos = _positions.get(index);
+    const bool pushed = pos < 0;
+    if (pushed) {
+      pos = _entries.size();
+      _entries.push_back(queue_entry_t());
+    }
+    sift_up(pos, queue_entry_t(cost, index));
+    return pushed;
+  }
+
+private:
+  inline void place(size_t pos, const queue_entry_t& entry) {
+    _entries[pos] = entry;
+    _positions[entry._index] = pos;
+  }
+
+  inline void sift_up(size_t pos, const queue_entry_t& entry) {
+    while (pos > 0) {
+      size_t parent = (pos - 1) / D;
+      if (!(entry._cost < _entries[parent]._cost)) break;
+      place(pos, _entries[parent]);
+      pos = parent;
+    }
+    place(pos, entry);
+  }
+
+  inline void sift_down(size_t pos, const queue_entry_t& entry) {
+    const size_t size = _entries.size();
+    for (;;) {
+      size_t child = pos * D + 1;
+      if (child >= size) break;
+      const size_t last = std::min(child + D, size);
+      size_t best = child;
+      for (++child; child < last; ++child) {
+        if (_entries[child]._cost < _entries[best]._cost) best = child;
+      }
+      if (!(_entries[best]._cost < entry._cost)) break;
+      place(pos, _entries[best]);
+      pos = best;
+    }
+    place(pos, entry);
+  }
+};
+
+template<template<typename> class grid_t>
+using dary_queue_t = indexed_dary_heap_t<4, grid_t>;
+
+
+// ======== Effective friction
+
+// Friction of a pixel as seen by the search of one transport layer: nodata
+// pixels get the nodata friction, the rest are clamped to the minimum
+// friction, and the result is halved so that the cost of a step is
+// (e[x] + e[n]) * d(x,n).
+struct friction_params_t {
+  float _noData;
+  float _minFriction;
+  float _noDataFriction;
+};
+
+// Friction given to pixels without data. Stepping on one costs more than
+// the whole search budget, so they are never crossed.
+inline float
+nodata_friction(float maxCost, float pixelWidthMeters, float pixelHeightMeters)
+{
+  const float diagCost = std::sqrt(pixelWidthMeters * pixelWidthMeters + pixelHeightMeters * pixelHeightMeters);
+  return 10 * maxCost / diagCost;
+}
+
+// Friction data of the searched window, either row-major or in the tiled
+// layout of a larger raster whose tiles line up with those of the window
+// (ie. the window starts on a tile boundary). Either way the pixels are read
+// in runs that do not cross a tile boundary, which are contiguous in both.
+struct friction_data_t {
+  const float *_data;
+  bool _tiled;
+  int  _stride;    // row-major: pixels per row; tiled: tiles per row
+  int  _tileXOff;  // tiled: tile of the data at the origin of the window
+  int  _tileYOff;
+
+  static friction_data_t row_major(const float *data, int width) {
+    return friction_data_t { data, false, width, 0, 0 };
+  }
+  static friction_data_t tiled(const float *data, int tilesX, int tileXOff, int tileYOff) {
+    return friction_data_t { data, true, tilesX, tileXOff, tileYOff };
+  }
+
+  // pixel x,y of the window, followed by the rest of its run
+  inline const float *run(int x, int y) const {
+    if (!_tiled) {
+      return _data + (size_t) y * _stride + x;
+    }
+    const int TILE_BITS = tiled_layout_t::TILE_BITS;
+    const int TILE_MASK = tiled_layout_t::TILE_MASK;
+    const size_t tile = (size_t) ((y >> TILE_BITS) + _tileYOff) * _stride + (x >> TILE_BITS) + _tileXOff;
+    return _data + (tile << (2 * TILE_BITS)) + ((y & TILE_MASK) << TILE_BITS) + (x & TILE_MASK);
+  }
+};
+
+// Builds the effective friction of every layer from the same friction data
+// in a single pass, writing it in the pixel layout. Rows are
+// handled in runs of TILE pixels, contiguous in both layouts, which are read
+// once and stay in cache while every layer is written; the branch free loop
+// over a run is left for the compiler to vectorize. Rows are spread over the
+// given number of threads.
+template<typename layout_t>
+inline void
+build_effective_friction(const layout_t& layout,
+                         const friction_data_t& friction,
+                         const std::vector<friction_params_t>& params,
+                         const std::vector<float *>& outputs,
+                         unsigned threads)
+{
+#ifdef BENCHMARK
+  boost::timer::auto_cpu_timer t(std::cerr, 6, "build_effective_friction: %t sec CPU, %w sec real\n");
+#endif
+
+  const int run = tiled_layout_t::TILE;
+  const int width = layout._width;
+  const int rowsPerTask = std::max(1, 65536 / width);
+  const size_t tasks = (layout._height + rowsPerTask - 1) / rowsPerTask;
+
+  parallel_for(tasks, threads, [&](size_t task) {
+    const int y1 = task * rowsPerTask;
+    const int y2 = std::min<int>(y1 + rowsPerTask, layout._height);
+    for (int y = y1; y < y2; ++y) {
+      for (int x0 = 0; x0 < width; x0 += run) {
+        const int count = std::min(run, width - x0);
+        const float *src = friction.run(x0, y);
+        const int offset = layout.index(x0, y);
+        for (size_t k = 0; k < params.size(); ++k) {
+          const float noData = params[k]._noData;
+          const float minFriction = params[k]._minFriction;
+          const float noDataFriction = params[k]._noDataFriction;
+          float *dst = outputs[k] + offset;
+          for (int i = 0; i < count; ++i) {
+            dst[i] = (src[i] == noData ? noDataFriction : std::max(src[i], minFriction)) * 0.5f;
+          }
+        }
+      }
+    }
+  });
+}
+
+// Effective friction of one layer on the tiled layout, computed a tile at
+// a time the first time the search reads a pixel in it.
+class lazy_effective_friction_t {
+  const tiled_layout_t& _layout;
+  const friction_data_t _friction;
+  const friction_params_t _params;
+  mutable sparse_grid_t<float> _grid;
+
+public:
+  lazy_effective_friction_t(const tiled_layout_t& layout, const friction_data_t& friction, const friction_params_t& params)
+    : _layout(layout), _friction(friction), _params(params), _grid(layout.size(), 0.0f) {}
+
+  inline float operator[](int index) const {
+    const size_t tile = index >> sparse_grid_t<float>::BLOCK_BITS;
+    if (!_grid.block(tile)) {
+      build_tile(tile);
+    }
+    return _grid.block(tile)[index & sparse_grid_t<float>::BLOCK_MASK];
+  }
+
+private:
+  void build_tile(size_t tile) const {
+    const int TILE = tiled_layout_t::TILE;
+    _grid.allocate(tile);
+    float *dst = _grid.block(tile);
+    const int x0 = (tile % _layout._tilesX) * TILE;
+    const int y0 = (tile / _layout._tilesX) * TILE;
+    const int count = std::min(TILE, _layout._width - x0);
+    const int rows = std::min(TILE, _layout._height - y0);
+    for (int y = 0; y < rows; ++y, dst += TILE) {
+      const float *src = _friction.run(x0, y0 + y);
+      for (int i = 0; i < count; ++i) {
+        dst[i] = (src[i] == _params._noData ? _params._noDataFriction : std::max(src[i], _params._minFriction)) * 0.5f;
+      }
+    }
+  }
+};
+
+
+// ======== Main algorithm
+
+// Work done by a search
+struct search_counters_t {
+  size_t _visited = 0;
+  size_t _pushes = 0;
+  size_t _decreases = 0;
+};
+
+// Labels carried by a search along with the costs: every pixel whose cost
+// improves takes the label of the pixel it is reached from, so that searches
+// from several origins know which one every pixel is nearest to.
+struct no_labels_t {
+  inline void carry(int, int) {}
+};
+
+template<typename grid_t>
+struct grid_labels_t {
+  grid_t& _labels;
+
+  inline void carry(int from, int to) { _labels[to] = _labels.get(from); }
+};
+
+// Runs the search from the pixels already in the queue, whose costs (and
+// labels) are already set. Both the effective friction and the cost layers
+// are given in the pixel layout. The work done is added to `counters` if
+// given.
+template<typename queue_t, typename layout_t, typename cost_t, typename labels_t, typename friction_t>
+inline void
+run_labelled_dijkstra_from_queue(queue_t& queue,
+                                 const layout_t& layout,
+                                 cost_t& cost,
+                                 labels_t& labels,
+                                 const friction_t& effectiveFriction,
+                                 const float pixelWidthMeters,
+                                 const float pixelHeightMeters,
+                                 const float maxCost,
+                                 search_counters_t *counters = NULL)
+{
+  const int width = layout._width;
+  const int height = layout._height;
+
+  size_t visited = 0;
+  size_t pushes = 0;
+  size_t decreases = 0;
+
+  const float horizCost = pixelWidthMeters;
+  const float vertCost = pixelHeightMeters;
+  const float diagCost = std::sqrt(horizCost * horizCost + vertCost * vertCost);
+
+  // while Q is not empty
+  while (!queue.empty()) {
+    // remove the location x with the least cost from Q
+    queue_entry_t x = queue.pop();
+    int xx, xy;
+    layout.coords(x._index, xx, xy);
+
+    visited++;
+
+    // for all neighbours n of x
+    const float ex = effectiveFriction[x._index];
+    int nx1 = xx > 0 ? xx - 1 : xx;
+    int nx2 = xx < width-1 ? xx + 1 : xx;
+    int ny1 = xy > 0 ? xy - 1 : xy;
+    int ny2 = xy < height-1 ? xy + 1 : xy;
+    for (int nx = nx1; nx <= nx2; nx++) {
+      for (int ny = ny1; ny <= ny2; ny++) {
+        if (nx == xx && ny == xy) continue;
+        float d_cost = (nx == xx) ? vertCost : ((ny == xy) ? horizCost : diagCost);
+        const int n = layout.index(nx, ny);
+
+        // compute the cost from x to n d(x,n) and C' <- C[x] + d(x,n)
+        // friction is given in minutes/meter, and already halved
+        float cn = cost.get(n);
+        float dxn = (ex + effectiveFriction[n]) * d_cost;
+        float cn_from_x = x._cost + dxn;
+
+        // if C[n] > C', C[n] <- C'
+        if (cn > cn_from_x) {
+          cost[n] = cn_from_x;
+          labels.carry(x._index, n);
+
+          // if C' < maxCost, add (or update) n to the visit queue
+          if (cn_from_x < maxCost) {
+            if (queue.push_or_decrease(n, cn_from_x)) {
+              pushes++;
+            } else {
+              decreases++;
+            }
+          }
+        }
+      }
+    }
+  }
+
+#ifdef BENCHMARK
+  std::cerr << "visited " << visited << std::endl;
+#endif
+  if (counters != NULL) {
+    counters->_visited += visited;
+    counters->_pushes += pushes;
+    counters->_decreases += decreases;
+  }
+}
+
+template<typename queue_t, typename layout_t, typename cost_t, typename friction_t>
+inline void
+run_dijkstra_from_queue(queue_t& queue,
+                        const layout_t& layout,
+                        cost_t& cost,
+                        const friction_t& effectiveFriction,
+                        const float pixelWidthMeters,
+                        const float pixelHeightMeters,
+                        const float maxCost,
+                        search_counters_t *counters = NULL)
+{
+  no_labels_t labels;
+  run_labelled_dijkstra_from_queue(queue, layout, cost, labels, effectiveFriction,
+                                   pixelWidthMeters, pixelHeightMeters, maxCost, counters);
+}
+
+template<typename queue_t, typename layout_t, typename cost_t, typename friction_t>
+inline void
+run_dijkstra_with_queue(queue_t& queue,
+                        const layout_t& layout,
+                        cost_t& cost,
+                        const friction_t& effectiveFriction,
+                        const float pixelWidthMeters,
+                        const float pixelHeightMeters,
+                        const int originX,
+                        const int originY,
+                        const float maxCost,
+                        search_counters_t *counters = NULL)
+{
+  // add origin to priority queue Q and set the cost of origin to 0 C[o] = 0
+  cost[layout.index(originX, originY)] = 0;
+  queue.push_or_decrease(layout.index(originX, originY), 0);
+  if (counters != NULL) {
+    counters->_pushes++;
+  }
+
+  run_dijkstra_from_queue(queue, layout, cost, effectiveFriction,
+                          pixelWidthMeters, pixelHeightMeters, maxCost, counters);
+}
+
+// Runs the search with the queue selected, keeping the heap positions in the
+// same kind of grid as the costs.
+template<template<typename> class grid_t, typename layout_t, typename friction_t>
+inline void
+run_dijkstra_with_layout(const layout_t& layout,
+                         grid_t<float>& cost,
+                         const friction_t& effectiveFriction,
+                         const float pixelWidthMeters,
+                         const float pixelHeightMeters,
+                         const int originX,
+                         const int originY,
+                         const float maxCost,
+                         const queue_kind_t queueKind,
+                         search_counters_t *counters = NULL)
+{
+#ifdef BENCHMARK
+  boost::timer::auto_cpu_timer t(std::cerr, 6, "run_dijkstra_with_layout: %t sec CPU, %w sec real\n");
+#endif
+
+  switch (queueKind) {
+  case QUEUE_BINOMIAL: {
+    binomial_queue_t<grid_t> queue(layout.size());
+    run_dijkstra_with_queue(queue, layout, cost, effectiveFriction,
+                            pixelWidthMeters, pixelHeightMeters, originX, originY, maxCost, counters);
+    break;
+  }
+  case QUEUE_DARY: {
+    dary_queue_t<grid_t> queue(layout.size());
+    run_dijkstra_with_queue(queue, layout, cost, effectiveFriction,
+                            pixelWidthMeters, pixelHeightMeters, originX, originY, maxCost, counters);
+    break;
+  }
+  }
+}
+
+// Cost layers of all the transport layers of a search, row-major over a
+// window of the searched area.
+struct search_result_t {
+  raster_window_t               _window;
+  std::vector<std::unique_ptr<float[]>>   _costs;
+  std::vector<std::unique_ptr<int32_t[]>> _labels; // nearest origin, of searches from several
+};
+
+// records the search of the transport layer in the statistics
+inline void
+add_search_stats(run_stats_t *stats, const search_counters_t& counters)
+{
+  if (stats == NULL) return;
+  stats->add_counter("pixels_visited", counters._visited);
+  stats->add_counter("heap_pushes", counters._pushes);
+  stats->add_counter("heap_decrease_keys", counters._decreases);
+}
+
+inline std::string
+layer_phase(const char *phase, size_t layer)
+{
+  return std::string(phase) + "_" + std::to_string(layer);
+}
+
+inline friction_params_t
+layer_friction_params(float frictionNoData, float maxCost, float minFriction,
+                      float pixelWidthMeters, float pixelHeightMeters)
+{
+  friction_params_t params;
+  params._noData = frictionNoData;
+  params._minFriction = minFriction;
+  params._noDataFriction = nodata_friction(maxCost, pixelWidthMeters, pixelHeightMeters);
+  return params;
+}
+
+inline std::unique_ptr<float[]>
+row_major_costs(const row_major_layout_t&, dense_grid_t<float>& cost)
+{
+  return cost.release();
+}
+
+inline std::unique_ptr<float[]>
+row_major_costs(const tiled_layout_t& layout, dense_grid_t<float>& cost)
+{
+  std::unique_ptr<float[]> pRowMajor(new float[(size_t) layout._width * layout._height]);
+  layout.to_row_major(cost.data(), pRowMajor.get());
+  return pRowMajor;
+}
+
+// Copies the costs (or labels) of the window out of a sparse grid;
+// unallocated tiles read as the grid initial value.
+template<typename T>
+inline std::unique_ptr<T[]>
+row_major_costs(const tiled_layout_t& layout, const sparse_grid_t<T>& cost, const raster_window_t& window)
+{
+  const int TILE = tiled_layout_t::TILE;
+  std::unique_ptr<T[]> pRowMajor(new T[(size_t) window._width * window._height]);
+  for (int y = 0; y < window._height; ++y) {
+    T *row = &pRowMajor[(size_t) y * window._width];
+    const int ly = window._yOff + y;
+    for (int x = 0; x < window._width; ) {
+      const int lx = window._xOff + x;
+      const int count = std::min(TILE - (lx & (TILE - 1)), window._width - x);
+      const int index = layout.index(lx, ly);
+      const T *block = cost.block(index >> sparse_grid_t<T>::BLOCK_BITS);
+      if (block) {
+        const T *src = block + (index & sparse_grid_t<T>::BLOCK_MASK);
+        std::copy(src, src + count, row + x);
+      } else {
+        std::fill(row + x, row + x + count, cost.value());
+      }
+      x += count;
+    }
+  }
+  return pRowMajor;
+}
+
+// Window of the tiles allocated in any of the sparse grids, clipped to the
+// layout; every pixel written by the searches is within it.
+inline raster_window_t
+allocated_window(const tiled_layout_t& layout, const std::vector<std::unique_ptr<sparse_grid_t<float>>>& grids)
+{
+  const int TILE = tiled_layout_t::TILE;
+  raster_window_t window = { 0, 0, 0, 0 };
+  for (auto& grid : grids) {
+    for (size_t tile = 0; tile < grid->block_count(); ++tile) {
+      if (!grid->block(tile)) continue;
+      raster_window_t tileWindow;
+      tileWindow._xOff = (tile % layout._tilesX) * TILE;
+      tileWindow._yOff = (tile / layout._tilesX) * TILE;
+      tileWindow._width = std::min(TILE, layout._width - tileWindow._xOff);
+      tileWindow._height = std::min(TILE, layout._height - tileWindow._yOff);
+      window = window.merge(tileWindow);
+    }
+  }
+  return window;
+}
+
+template<typename layout_t>
+inline search_result_t
+run_dense_search(const layout_t& layout,
+                 const friction_data_t& friction,
+                 const float frictionNoData,
+                 const float pixelWidthMeters,
+                 const float pixelHeightMeters,
+                 const int originX,
+                 const int originY,
+                 const std::vector<float>& maxCosts,
+                 const std::vector<float>& minFrictions,
+                 const queue_kind_t queueKind,
+                 unsigned threads,
+                 run_stats_t *stats)
+{
+  const size_t layerCount = maxCosts.size();
+  phase_timer_t frictionTimer(stats, "effective_friction");
+  std::vector<friction_params_t> params;
+  std::vector<std::unique_ptr<float[]>> effective;
+  std::vector<float *> outputs;
+  for (size_t i = 0; i < layerCount; ++i) {
+    params.push_back(layer_friction_params(frictionNoData, maxCosts[i], minFrictions[i],
+                                           pixelWidthMeters, pixelHeightMeters));
+    effective.emplace_back(new float[layout.size()]);
+    outputs.push_back(effective.back().get());
+  }
+  build_effective_friction(layout, friction, params, outputs, threads);
+  frictionTimer.stop();
+
+  // transport layers are independent searches, so each one runs on its own
+  // thread with its own cost buffer
+  search_result_t result;
+  result._window = { 0, 0, layout._width, layout._height };
+  result._costs.resize(layerCount);
+  parallel_for(layerCount, threads, [&](size_t i) {
+    // initialize cost layer to infinity C[x] <- inf forall x
+    phase_timer_t timer(stats, layer_phase("dijkstra", i));
+    dense_grid_t<float> cost(layout.size(), 10 * maxCosts[i] /* numeric_limits<float>::infinity() */);
+    const float* pEffectiveFriction = effective[i].get();
+    search_counters_t counters;
+    run_dijkstra_with_layout(layout, cost, pEffectiveFriction,
+                             pixelWidthMeters, pixelHeightMeters, originX, originY, maxCosts[i], queueKind,
+                             &counters);
+    timer.stop();
+    add_search_stats(stats, counters);
+    effective[i].reset();
+    phase_timer_t collectTimer(stats, "collect_costs");
+    result._costs[i] = row_major_costs(layout, cost);
+  });
+  return result;
+}
+
+// Pixels outside the allocated tiles were never written, so only the window
+// around them is handed back. The grids are freed as they are copied.
+inline search_result_t
+collect_sparse_costs(const tiled_layout_t& layout,
+                     std::vector<std::unique_ptr<sparse_grid_t<float>>>& costs,
+                     run_stats_t *stats)
+{
+  phase_timer_t collectTimer(stats, "collect_costs");
+  search_result_t result;
+  result._window = allocated_window(layout, costs);
+  for (auto& cost : costs) {
+    result._costs.push_back(row_major_costs(layout, *cost, result._window));
+    cost.reset();
+  }
+  return result;
+}
+
+inline search_result_t
+run_sparse_search(const tiled_layout_t& layout,
+                  const friction_data_t& friction,
+                  const float frictionNoData,
+                  const float pixelWidthMeters,
+                  const float pixelHeightMeters,
+                  const int originX,
+                  const int originY,
+                  const std::vector<float>& maxCosts,
+                  const std::vector<float>& minFrictions,
+                  const queue_kind_t queueKind,
+                  unsigned threads,
+                  run_stats_t *stats)
+{
+  const size_t layerCount = maxCosts.size();
+  std::vector<std::unique_ptr<sparse_grid_t<float>>> costs(layerCount);
+  parallel_for(layerCount, threads, [&](size_t i) {
+    // the effective friction is built as the search reaches every tile, so
+    // it is timed as part of the search
+    phase_timer_t timer(stats, layer_phase("dijkstra", i));
+    lazy_effective_friction_t effectiveFriction(layout, friction,
+                                                layer_friction_params(frictionNoData, maxCosts[i], minFrictions[i],
+                                                                      pixelWidthMeters, pixelHeightMeters));
+    costs[i].reset(new sparse_grid_t<float>(layout.size(), 10 * maxCosts[i]));
+    search_counters_t counters;
+    run_dijkstra_with_layout(layout, *costs[i], effectiveFriction,
+                             pixelWidthMeters, pixelHeightMeters, originX, originY, maxCosts[i], queueKind,
+                             &counters);
+    timer.stop();
+    add_search_stats(stats, counters);
+  });
+
+  return collect_sparse_costs(layout, costs, stats);
+}
+
+// Searches every transport layer on the same friction data, returning their
+// cost layers in row-major order whatever the layout used during the search.
+// With sparse state only the tiles reached by the search are allocated, and
+// the costs are returned for the window covering them (in pixels of the
+// friction data); with dense state the window is the whole friction data.
+// The phases and search counters are added to `stats` if given.
+inline search_result_t
+run_dijkstra_on_friction_layers(const friction_data_t& friction,
+                                const int width,
+                                const int height,
+                                const float frictionNoData,
+                                const float pixelWidthMeters,
+                                const float pixelHeightMeters,
+                                const int originX,
+                                const int originY,
+                                const std::vector<float>& maxCosts,
+                                const std::vector<float>& minFrictions,
+                                const queue_kind_t queueKind = QUEUE_DARY,
+                                const layout_kind_t layoutKind = LAYOUT_TILED,
+                                const search_state_kind_t stateKind = STATE_SPARSE,
+                                unsigned threads = 1,
+                                run_stats_t *stats = NULL)
+{
+  if (layoutKind == LAYOUT_ROW_MAJOR) {
+    if (stateKind == STATE_SPARSE) {
+      throw std::runtime_error("sparse search state requires the tiled layout");
+    }
+    return run_dense_search(row_major_layout_t(width, height), friction, frictionNoData,
+                            pixelWidthMeters, pixelHeightMeters, originX, originY,
+                            maxCosts, minFrictions, queueKind, threads, stats);
+  }
+
+  tiled_layout_t layout(width, height);
+  if (stateKind == STATE_SPARSE) {
+    return run_sparse_search(layout, friction, frictionNoData,
+                             pixelWidthMeters, pixelHeightMeters, originX, originY,
+                             maxCosts, minFrictions, queueKind, threads, stats);
+  }
+  return run_dense_search(layout, friction, frictionNoData,
+                          pixelWidthMeters, pixelHeightMeters, originX, originY,
+                          maxCosts, minFrictions, queueKind, threads, stats);
+}
+
+inline search_result_t
+run_dijkstra_on_friction_layers(const float* pFrictionData,
+                                const int width,
+                                const int height,
+                                const float frictionNoData,
+                                const float pixelWidthMeters,
+                                const float pixelHeightMeters,
+                                const int originX,
+                                const int originY,
+                                const std::vector<float>& maxCosts,
+                                const std::vector<float>& minFrictions,
+                                const queue_kind_t queueKind = QUEUE_DARY,
+                                const layout_kind_t layoutKind = LAYOUT_TILED,
+                                const search_state_kind_t stateKind = STATE_SPARSE,
+                                unsigned threads = 1,
+                                run_stats_t *stats = NULL)
+{
+  return run_dijkstra_on_friction_layers(friction_data_t::row_major(pFrictionData, width), width, height,
+                                         frictionNoData, pixelWidthMeters, pixelHeightMeters,
+                                         originX, originY, maxCosts, minFrictions,
+                                         queueKind, layoutKind, stateKind, threads, stats);
+}
+
+// ======== Nearest origin search
+
+// Label of the pixels not reached from any origin.
+const int32_t NO_ORIGIN = 0;
+
+// Seeds the queue with every origin within the layout at cost 0, labelled by
+// its position in `origins` from 1, and runs a single search from all of
+// them. An origin on the pixel of a previous one is left to the previous one.
+template<typename queue_t, typename friction_t>
+inline void
+run_nearest_with_queue(queue_t& queue,
+                       const tiled_layout_t& layout,
+                       sparse_grid_t<float>& cost,
+                       sparse_grid_t<int32_t>& labels,
+                       const friction_t& effectiveFriction,
+                       const float pixelWidthMeters,
+                       const float pixelHeightMeters,
+                       const std::vector<pixel_coords_t>& origins,
+                       const float maxCost,
+                       search_counters_t *counters = NULL)
+{
+  for (size_t i = 0; i < origins.size(); ++i) {
+    const int x = origins[i].first, y = origins[i].second;
+    if (x < 0 || y < 0 || x >= layout._width || y >= layout._height) continue;
+    const int index = layout.index(x, y);
+    if (cost.get(index) == 0) continue;
+    cost[index] = 0;
+    labels[index] = (int32_t) i + 1;
+    queue.push_or_decrease(index, 0);
+    if (counters != NULL) {
+      counters->_pushes++;
+    }
+  }
+
+  grid_labels_t<sparse_grid_t<int32_t>> carried = { labels };
+  run_labelled_dijkstra_from_queue(queue, layout, cost, carried, effectiveFriction,
+                                   pixelWidthMeters, pixelHeightMeters, maxCost, counters);
+}
+
+// Searches every transport layer from all the origins at once, instead of
+// once per origin: every pixel gets the cost from its nearest origin, and
+// the label of that origin (its position in `origins` from 1, or NO_ORIGIN
+// where none is reached) in the `_labels` of the result. Origins outside
+// the friction data are skipped. The search runs on the tiled layout with
+// sparse state, and returns the window reached as run_sparse_search().
+inline search_result_t
+run_nearest_search(const friction_data_t& friction,
+                   const int width,
+                   const int height,
+                   const float frictionNoData,
+                   const float pixelWidthMeters,
+                   const float pixelHeightMeters,
+                   const std::vector<pixel_coords_t>& origins,
+                   const std::vector<float>& maxCosts,
+                   const std::vector<float>& minFrictions,
+                   const queue_kind_t queueKind = QUEUE_DARY,
+                   unsigned threads = 1,
+                   run_stats_t *stats = NULL)
+{
+  const tiled_layout_t layout(width, height);
+  const size_t layerCount = maxCosts.size();
+  std::vector<std::unique_ptr<sparse_grid_t<float>>> costs(layerCount);
+  std::vector<std::unique_ptr<sparse_grid_t<int32_t>>> labels(layerCount);
+  parallel_for(layerCount, threads, [&](size_t i) {
+    phase_timer_t timer(stats, layer_phase("dijkstra", i));
+    lazy_effective_friction_t effectiveFriction(layout, friction,
+                                                layer_friction_params(frictionNoData, maxCosts[i], minFrictions[i],
+                                                                      pixelWidthMeters, pixelHeightMeters));
+    costs[i].reset(new sparse_grid_t<float>(layout.size(), 10 * maxCosts[i]));
+    labels[i].reset(new sparse_grid_t<int32_t>(layout.size(), NO_ORIGIN));
+    search_counters_t counters;
+    switch (queueKind) {
+    case QUEUE_BINOMIAL: {
+      binomial_queue_t<sparse_grid_t> queue(layout.size());
+      run_nearest_with_queue(queue, layout, *costs[i], *labels[i], effectiveFriction,
+                             pixelWidthMeters, pixelHeightMeters, origins, maxCosts[i], &counters);
+      break;
+    }
+    case QUEUE_DARY: {
+      dary_queue_t<sparse_grid_t> queue(layout.size());
+      run_nearest_with_queue(queue, layout, *costs[i], *labels[i], effectiveFriction,
+                             pixelWidthMeters, pixelHeightMeters, origins, maxCosts[i], &counters);
+      break;
+    }
+    }
+    timer.stop();
+    add_search_stats(stats, counters);
+  });
+  if (stats != NULL) {
+    stats->add_counter("origins", origins.size());
+  }
+
+  search_result_t result = collect_sparse_costs(layout, costs, stats);
+  phase_timer_t collectTimer(stats, "collect_labels");
+  for (auto& layerLabels : labels) {
+    result._labels.push_back(row_major_costs(layout, *layerLabels, result._window));
+    layerLabels.reset();
+  }
+  return result;
+}
+
+
+// ======== Resumed search
+
+// Sets the costs of a search that stopped at previousMaxCost, given
+// row-major over a window of the layout, and carries it on up to maxCost.
+// The pixels it settled (those below previousMaxCost) keep their costs; the
+// pixels around them are relaxed again from them, since the friction of
+// pixels without data grows with the maximum cost, and the search goes on
+// from there as if it had never stopped. Returns the pixels settled before.
+template<typename queue_t, typename friction_t>
+inline size_t
+resume_dijkstra_with_queue(queue_t& queue,
+                           const tiled_layout_t& layout,
+                           sparse_grid_t<float>& cost,
+                           const friction_t& effectiveFriction,
+                           const float pixelWidthMeters,
+                           const float pixelHeightMeters,
+                           const float *previousCost,
+                           const raster_window_t& previousWindow,
+                           const float previousMaxCost,
+                           const float maxCost,
+                           search_counters_t *counters = NULL)
+{
+  const int width = previousWindow._width;
+  const int height = previousWindow._height;
+  auto settled = [&](int x, int y) {
+    return x >= 0 && y >= 0 && x < width && y < height && previousCost[(size_t) y * width + x] < previousMaxCost;
+  };
+
+  size_t settledCount = 0;
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      if (!settled(x, y)) continue;
+      cost[layout.index(previousWindow._xOff + x, previousWindow._yOff + y)] = previousCost[(size_t) y * width + x];
+      settledCount++;
+    }
+  }
+
+  const float horizCost = pixelWidthMeters;
+  const float vertCost = pixelHeightMeters;
+  const float diagCost = std::sqrt(horizCost * horizCost + vertCost * vertCost);
+  size_t pushes = 0;
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      if (!settled(x, y)) continue;
+      const int xx = previousWindow._xOff + x;
+      const int xy = previousWindow._yOff + y;
+      const float cx = previousCost[(size_t) y * width + x];
+      int nx1 = xx > 0 ? xx - 1 : xx;
+      int nx2 = xx < layout._width-1 ? xx + 1 : xx;
+      int ny1 = xy > 0 ? xy - 1 : xy;
+      int ny2 = xy < layout._height-1 ? xy + 1 : xy;
+      for (int nx = nx1; nx <= nx2; nx++) {
+        for (int ny = ny1; ny <= ny2; ny++) {
+          if (settled(nx - previousWindow._xOff, ny - previousWindow._yOff)) continue;
+          float d_cost = (nx == xx) ? vertCost : ((ny == xy) ? horizCost : diagCost);
+          const int n = layout.index(nx, ny);
+          float cn_from_x = cx + (effectiveFriction[layout.index(xx, xy)] + effectiveFriction[n]) * d_cost;
+          if (cost.get(n) > cn_from_x) {
+            cost[n] = cn_from_x;
+            if (cn_from_x < maxCost) {
+              if (queue.push_or_decrease(n, cn_from_x)) {
+                pushes++;
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+  if (counters != NULL) {
+    counters->_pushes += pushes;
+  }
+
+  run_dijkstra_from_queue(queue, layout, cost, effectiveFriction,
+                          pixelWidthMeters, pixelHeightMeters, maxCost, counters);
+  return settledCount;
+}
+
+// Carries on the searches of every transport layer that stopped at
+// previousMaxCosts, with costs given row-major over a window of the
+// friction data, up to maxCosts (which must not be lower). Only the pixels
+// beyond the previous searches are searched, on the tiled layout with
+// sparse state, and the costs are the same as those of new searches. The
+// result is returned as run_sparse_search().
+inline search_result_t
+run_resumed_search(const friction_data_t& friction,
+                   const int width,
+                   const int height,
+                   const float frictionNoData,
+                   const float pixelWidthMeters,
+                   const float pixelHeightMeters,
+                   const std::vector<const float *>& previousCosts,
+                   const raster_window_t& previousWindow,
+                   const std::vector<float>& previousMaxCosts,
+                   const std::vector<float>& maxCosts,
+                   const std::vector<float>& minFrictions,
+                   const queue_kind_t queueKind = QUEUE_DARY,
+                   unsigned threads = 1,
+                   run_stats_t *stats = NULL)
+{
+  const tiled_layout_t layout(width, height);
+  const size_t layerCount = maxCosts.size();
+  std::vector<std::unique_ptr<sparse_grid_t<float>>> costs(layerCount);
+  parallel_for(layerCount, threads, [&](size_t i) {
+    phase_timer_t timer(stats, layer_phase("dijkstra", i));
+    lazy_effective_friction_t effectiveFriction(layout, friction,
+                                                layer_friction_params(frictionNoData, maxCosts[i], minFrictions[i],
+                                                                      pixelWidthMeters, pixelHeightMeters));
+    costs[i].reset(new sparse_grid_t<float>(layout.size(), 10 * maxCosts[i]));
+    search_counters_t counters;
+    size_t resumed = 0;
+    switch (queueKind) {
+    case QUEUE_BINOMIAL: {
+      binomial_queue_t<sparse_grid_t> queue(layout.size());
+      resumed = resume_dijkstra_with_queue(queue, layout, *costs[i], effectiveFriction,
+                                           pixelWidthMeters, pixelHeightMeters,
+                                           previousCosts[i], previousWindow, previousMaxCosts[i], maxCosts[i],
+                                           &counters);
+      break;
+    }
+    case QUEUE_DARY: {
+      dary_queue_t<sparse_grid_t> queue(layout.size());
+      resumed = resume_dijkstra_with_queue(queue, layout, *costs[i], effectiveFriction,
+                                           pixelWidthMeters, pixelHeightMeters,
+                                           previousCosts[i], previousWindow, previousMaxCosts[i], maxCosts[i],
+                                           &counters);
+      break;
+    }
+    }
+    timer.stop();
+    add_search_stats(stats, counters);
+    if (stats != NULL) {
+      stats->add_counter("pixels_resumed", resumed);
+    }
+  });
+
+  return collect_sparse_costs(layout, costs, stats);
+}
+
+
+// ======== Parallel search
+
+// Relaxation of a pixel from a neighbour in another tile. The tile of the
+// pixel completes the cost with its effective friction, in the same order of
+// operations as the sequential search.
+struct tile_message_t {
+  int   _index;
+  float _cost;      // of the neighbour
+  float _friction;  // effective friction of the neighbour
+  float _distance;
+};
+
+struct search_tile_t {
+  std::unique_ptr<indexed_dary_heap_t<4, dense_grid_t>> _heap;  // by pixel within the tile
+  std::vector<tile_message_t> _inbox;
+  float _key = std::numeric_limits<float>::infinity();           // while waiting for a thread
+  bool  _claimed = false;
+};
+
+// Searches one transport layer on several threads. The tiles of the layout
+// are claimed by one thread at a time, cheapest pending pixel first, and
+// searched with their own heap up to `delta` beyond that pixel before being
+// handed back, so that the threads advance together along the frontier as in
+// delta-stepping. Pixels relaxed across a tile border are sent to the inbox
+// of their tile instead of being written, so the costs, effective friction
+// and heap of a tile are only touched by the thread holding it. A pixel can
+// be searched before its final cost is known, and is searched again when a
+// cheaper one arrives; once no tile has pending work every pixel has the
+// cost of the sequential search. Returns the number of times a tile was
+// claimed.
+template<typename friction_t>
+inline size_t
+run_parallel_dijkstra(const tiled_layout_t& layout,
+                      sparse_grid_t<float>& cost,
+                      const friction_t& effectiveFriction,
+                      const float pixelWidthMeters,
+                      const float pixelHeightMeters,
+                      const int originX,
+                      const int originY,
+                      const float maxCost,
+                      const float delta,
+                      unsigned threads,
+                      search_counters_t *counters = NULL)
+{
+  const int TILE_SHIFT = 2 * tiled_layout_t::TILE_BITS;
+  const int TILE_PIXELS = 1 << TILE_SHIFT;
+  const int width = layout._width;
+  const int height = layout._height;
+  const float horizCost = pixelWidthMeters;
+  const float vertCost = pixelHeightMeters;
+  const float diagCost = std::sqrt(horizCost * horizCost + vertCost * vertCost);
+
+  std::vector<search_tile_t> tiles((size_t) layout._tilesX * layout._tilesY);
+  std::set<std::pair<float, int>> waiting;  // tiles with pending work, by their key
+  unsigned claimed = 0;
+  size_t claims = 0;
+  std::mutex tilesMutex;
+  std::condition_variable changed;
+
+  // (with the mutex held) lowers the key of a tile not claimed by a thread
+  auto wait_for_thread = [&](int t, float key) {
+    search_tile_t& tile = tiles[t];
+    if (tile._claimed || !(key < tile._key)) return;
+    if (tile._key < std::numeric_limits<float>::infinity()) {
+      waiting.erase(std::make_pair(tile._key, t));
+    }
+    tile._key = key;
+    waiting.insert(std::make_pair(key, t));
+  };
+
+  const int origin = layout.index(originX, originY);
+  cost[origin] = 0;
+  search_tile_t& originTile = tiles[origin >> TILE_SHIFT];
+  originTile._heap.reset(new indexed_dary_heap_t<4, dense_grid_t>(TILE_PIXELS));
+  originTile._heap->push_or_decrease(origin & (TILE_PIXELS - 1), 0);
+  wait_for_thread(origin >> TILE_SHIFT, 0);
+
+  parallel_for(threads, threads, [&](size_t) {
+    size_t visited = 0;
+    size_t pushes = 0;
+    size_t decreases = 0;
+    std::vector<tile_message_t> inbox;
+    std::vector<tile_message_t> outbox;
+
+    std::unique_lock<std::mutex> lock(tilesMutex);
+    for (;;) {
+      while (waiting.empty() && claimed > 0) {
+        changed.wait(lock);
+      }
+      if (waiting.empty()) break;
+
+      const int t = waiting.begin()->second;
+      const float bound = waiting.begin()->first + delta;
+      waiting.erase(waiting.begin());
+      search_tile_t& tile = tiles[t];
+      tile._key = std::numeric_limits<float>::infinity();
+      tile._claimed = true;
+      claimed++;
+      claims++;
+      inbox.swap(tile._inbox);
+      lock.unlock();
+
+      if (!tile._heap) {
+        tile._heap.reset(new indexed_dary_heap_t<4, dense_grid_t>(TILE_PIXELS));
+      }
+      indexed_dary_heap_t<4, dense_grid_t>& heap = *tile._heap;
+      const int base = t << TILE_SHIFT;
+
+      for (const tile_message_t& message : inbox) {
+        const int n = message._index;
+        const float cn_from_x = message._cost + (message._friction + effectiveFriction[n]) * message._distance;
+        if (cost.get(n) > cn_from_x) {
+          cost[n] = cn_from_x;
+          if (cn_from_x < maxCost) {
+            if (heap.push_or_decrease(n - base, cn_from_x)) {
+              pushes++;
+            } else {
+              decreases++;
+            }
+          }
+        }
+      }
+      inbox.clear();
+
+      while (!heap.empty() && heap.top()._cost <= bound) {
+        queue_entry_t x = heap.pop();
+        x._index += base;
+        int xx, xy;
+        layout.coords(x._index, xx, xy);
+
+        visited++;
+
+        const float ex = effectiveFriction[x._index];
+        int nx1 = xx > 0 ? xx - 1 : xx;
+        int nx2 = xx < width-1 ? xx + 1 : xx;
+        int ny1 = xy > 0 ? xy - 1 : xy;
+        int ny2 = xy < height-1 ? xy + 1 : xy;
+        for (int nx = nx1; nx <= nx2; nx++) {
+          for (int ny = ny1; ny <= ny2; ny++) {
+            if (nx == xx && ny == xy) continue;
+            float d_cost = (nx == xx) ? vertCost : ((ny == xy) ? horizCost : diagCost);
+            const int n = layout.index(nx, ny);
+            if ((n >> TILE_SHIFT) != t) {
+              outbox.push_back(tile_message_t { n, x._cost, ex, d_cost });
+              continue;
+            }
+
+            float cn = cost.get(n);
+            float cn_from_x = x._cost + (ex + effectiveFriction[n]) * d_cost;
+            if (cn > cn_from_x) {
+              cost[n] = cn_from_x;
+              if (cn_from_x < maxCost) {
+                if (heap.push_or_decrease(n - base, cn_from_x)) {
+                  pushes++;
+                } else {
+                  decreases++;
+                }
+              }
+            }
+          }
+        }
+      }
+
+      lock.lock();
+      for (const tile_message_t& message : outbox) {
+        const int u = message._index >> TILE_SHIFT;
+        tiles[u]._inbox.push_back(message);
+        wait_for_thread(u, message._cost);
+      }
+      outbox.clear();
+
+      // messages may have arrived while the tile was claimed
+      tile._claimed = false;
+      claimed--;
+      float key = heap.empty() ? std::numeric_limits<float>::infinity() : heap.top()._cost;
+      for (const tile_message_t& message : tile._inbox) {
+        key = std::min(key, message._cost);
+      }
+      if (key < std::numeric_limits<float>::infinity()) {
+        wait_for_thread(t, key);
+      } else {
+        tile._heap.reset();
+      }
+      changed.notify_all();
+    }
+
+    // the mutex is still held
+    if (counters != NULL) {
+      counters->_visited += visited;
+      counters->_pushes += pushes;
+      counters->_decreases += decreases;
+    }
+  });
+
+  if (counters != NULL) {
+    counters->_pushes++;
+  }
+  return claims;
+}
+
+// Searches every transport layer with the parallel search, one after the
+// other, each on all the threads. The costs are returned as with the sparse
+// search state, which it shares.
+inline search_result_t
+run_parallel_search(const friction_data_t& friction,
+                    const int width,
+                    const int height,
+                    const float frictionNoData,
+                    const float pixelWidthMeters,
+                    const float pixelHeightMeters,
+                    const int originX,
+                    const int originY,
+                    const std::vector<float>& maxCosts,
+                    const std::vector<float>& minFrictions,
+                    unsigned threads = 1,
+                    run_stats_t *stats = NULL)
+{
+  const tiled_layout_t layout(width, height);
+  const size_t layerCount = maxCosts.size();
+  std::vector<std::unique_ptr<sparse_grid_t<float>>> costs(layerCount);
+  for (size_t i = 0; i < layerCount; ++i) {
+    phase_timer_t timer(stats, layer_phase("dijkstra", i));
+    lazy_effective_friction_t effectiveFriction(layout, friction,
+                                                layer_friction_params(frictionNoData, maxCosts[i], minFrictions[i],
+                                                                      pixelWidthMeters, pixelHeightMeters));
+    costs[i].reset(new sparse_grid_t<float>(layout.size(), 10 * maxCosts[i]));
+
+    // the frontier advances by about 1/64th of the budget at a time: less
+    // makes the threads wait on each other, more makes them search pixels
+    // again as cheaper costs arrive from the tiles behind
+    const float delta = maxCosts[i] / 64;
+    search_counters_t counters;
+    const size_t claims = run_parallel_dijkstra(layout, *costs[i], effectiveFriction,
+                                                pixelWidthMeters, pixelHeightMeters, originX, originY,
+                                                maxCosts[i], delta, threads, &counters);
+    timer.stop();
+    add_search_stats(stats, counters);
+    if (stats != NULL) {
+      stats->add_counter("tile_claims", claims);
+    }
+  }
+  return collect_sparse_costs(layout, costs, stats);
+}
+
+// ======== Fast sweeping
+
+// Solves the eikonal equation |grad T| = friction on the pixel centres
+// rather than searching the graph of the 8 neighbours, so the costs follow
+// the straight line in every direction instead of the 8 directions of the
+// graph, and isochrones on uniform friction are circles rather than
+// octagons. Costs are updated in place with the first order Godunov upwind
+// scheme from the cheapest horizontal and vertical neighbours, sweeping the
+// rows in the 4 combinations of directions until a round of sweeps changes
+// nothing. Obstacles make the characteristics turn, and every turn costs
+// another round.
+//
+// The friction towards a neighbour is the mean of both pixels, as for a step
+// of the searches, and as with them pixels costing the budget or more do not
+// spread their cost: the pixels just beyond the budget get a cost and the
+// rest keep their initial one. Only the rows and columns around the pixels
+// already within the budget are swept. Unlike the searches, the sweeps do
+// not step diagonally between pixels that only touch at a corner.
+
+// One sweep in the direction dx, dy (+1 or -1) over row-major costs and
+// effective friction; `reached` is the window of the pixels within the
+// budget, grown as they are found. Returns whether any cost decreased.
+inline bool
+sweep_costs(float *cost,
+            const float *effectiveFriction,
+            const int width,
+            const int height,
+            const float pixelWidthMeters,
+            const float pixelHeightMeters,
+            const float maxCost,
+            const int dx,
+            const int dy,
+            raster_window_t& reached,
+            size_t& updates)
+{
+  const float inf = std::numeric_limits<float>::infinity();
+  const int x1 = reached._xOff, x2 = reached._xOff + reached._width - 1;
+  const int y1 = reached._yOff, y2 = reached._yOff + reached._height - 1;
+  raster_window_t found = reached;
+  bool changed = false;
+
+  // the cheapest of two neighbours spreading their cost, with its friction
+  auto cheapest = [maxCost](const float *c, const float *e, int i, int j, float& value, float& friction) {
+    value = std::numeric_limits<float>::infinity();
+    friction = 0;
+    if (i >= 0 && c[i] < maxCost) {
+      value = c[i];
+      friction = e[i];
+    }
+    if (j >= 0 && c[j] < maxCost && c[j] < value) {
+      value = c[j];
+      friction = e[j];
+    }
+  };
+
+  // rows beyond the window are swept as long as the previous one reached
+  // any pixel, and every row as far as the previous one did plus one pixel
+  int previousLo = x1, previousHi = x2;
+  bool previousReached = true;
+  for (int y = dy > 0 ? std::max(0, y1 - 1) : std::min(height - 1, y2 + 1); y >= 0 && y < height; y += dy) {
+    if ((dy > 0 ? y > y2 : y < y1) && !previousReached) break;
+
+    const size_t offset = (size_t) y * width;
+    float *row = cost + offset;
+    const float *rowFriction = effectiveFriction + offset;
+    const int lo = std::max(0, std::min(x1, previousLo) - 1);
+    const int hi = std::min(width - 1, std::max(x2, previousHi) + 1);
+    int rowLo = width, rowHi = -1;
+
+    // pixels beyond the range are swept while the previous one is reached
+    for (int x = dx > 0 ? lo : hi; x >= 0 && x < width; x += dx) {
+      if ((dx > 0 ? x > hi : x < lo) && !(row[x - dx] < maxCost)) break;
+
+      float a, ea, b, eb;
+      cheapest(row, rowFriction, x > 0 ? x - 1 : -1, x < width - 1 ? x + 1 : -1, a, ea);
+      cheapest(cost, effectiveFriction, y > 0 ? (int) (offset + x - width) : -1,
+               y < height - 1 ? (int) (offset + x + width) : -1, b, eb);
+      if (a == inf && b == inf) continue;
+
+      // the cheapest neighbour alone, or both if they are close enough
+      const float e = rowFriction[x];
+      const float stepA = (e + ea) * pixelWidthMeters;
+      const float stepB = (e + eb) * pixelHeightMeters;
+      float t = std::min(a + stepA, b + stepB);
+      if (t > std::max(a, b)) {
+        const float wa = 1 / (stepA * stepA);
+        const float wb = 1 / (stepB * stepB);
+        t = (wa * a + wb * b + std::sqrt(std::max(0.0f, wa + wb - wa * wb * (a - b) * (a - b)))) / (wa + wb);
+      }
+      updates++;
+      if (t < row[x]) {
+        row[x] = t;
+        changed = true;
+      }
+      if (row[x] < maxCost) {
+        rowLo = std::min(rowLo, x);
+        rowHi = std::max(rowHi, x);
+      }
+    }
+
+    previousReached = rowHi >= 0;
+    if (previousReached) {
+      previousLo = rowLo;
+      previousHi = rowHi;
+      found = found.merge(raster_window_t { rowLo, y, rowHi - rowLo + 1, 1 });
+    } else {
+      previousLo = x1;
+      previousHi = x2;
+    }
+  }
+
+  reached = found;
+  return changed;
+}
+
+// Costs of one transport layer, row-major, from the effective friction of
+// the row-major layout. Returns the number of sweeps.
+inline size_t
+run_fast_sweeping(float *cost,
+                  const float *effectiveFriction,
+                  const int width,
+                  const int height,
+                  const float pixelWidthMeters,
+                  const float pixelHeightMeters,
+                  const int originX,
+                  const int originY,
+                  const float maxCost,
+                  search_counters_t *counters = NULL)
+{
+  cost[(size_t) originY * width + originX] = 0;
+  raster_window_t reached = { originX, originY, 1, 1 };
+  const int directions[4][2] = { { 1, 1 }, { -1, 1 }, { -1, -1 }, { 1, -1 } };
+  size_t sweeps = 0;
+  size_t updates = 0;
+  for (bool changed = true; changed; ) {
+    changed = false;
+    for (auto& direction : directions) {
+      changed = sweep_costs(cost, effectiveFriction, width, height, pixelWidthMeters, pixelHeightMeters,
+                            maxCost, direction[0], direction[1], reached, updates) || changed;
+      sweeps++;
+    }
+  }
+
+  if (counters != NULL) {
+    counters->_visited += updates;
+  }
+  return sweeps;
+}
+
+// Costs of every transport layer with fast sweeping, each on its own thread,
+// over the whole friction data in row-major order.
+inline search_result_t
+run_sweep_search(const friction_data_t& friction,
+                 const int width,
+                 const int height,
+                 const float frictionNoData,
+                 const float pixelWidthMeters,
+                 const float pixelHeightMeters,
+                 const int originX,
+                 const int originY,
+                 const std::vector<float>& maxCosts,
+                 const std::vector<float>& minFrictions,
+                 unsigned threads = 1,
+                 run_stats_t *stats = NULL)
+{
+  const row_major_layout_t layout(width, height);
+  const size_t layerCount = maxCosts.size();
+  phase_timer_t frictionTimer(stats, "effective_friction");
+  std::vector<friction_params_t> params;
+  std::vector<std::unique_ptr<float[]>> effective;
+  std::vector<float *> outputs;
+  for (size_t i = 0; i < layerCount; ++i) {
+    params.push_back(layer_friction_params(frictionNoData, maxCosts[i], minFrictions[i],
+                                           pixelWidthMeters, pixelHeightMeters));
+    effective.emplace_back(new float[layout.size()]);
+    outputs.push_back(effective.back().get());
+  }
+  build_effective_friction(layout, friction, params, outputs, threads);
+  frictionTimer.stop();
+
+  search_result_t result;
+  result._window = { 0, 0, width, height };
+  result._costs.resize(layerCount);
+  parallel_for(layerCount, threads, [&](size_t i) {
+    phase_timer_t timer(stats, layer_phase("sweep", i));
+    result._costs[i].reset(new float[layout.size()]);
+    std::fill(result._costs[i].get(), result._costs[i].get() + layout.size(), 10 * maxCosts[i]);
+    search_counters_t counters;
+    const size_t sweeps = run_fast_sweeping(result._costs[i].get(), effective[i].get(), width, height,
+                                            pixelWidthMeters, pixelHeightMeters, originX, originY,
+                                            maxCosts[i], &counters);
+    timer.stop();
+    effective[i].reset();
+    if (stats != NULL) {
+      stats->add_counter("pixel_updates", counters._visited);
+      stats->add_counter("sweeps", sweeps);
+    }
+  });
+  return result;
+}
+
+// ======== Pyramid search
+
+// Coarse to fine search for large budgets. The effective friction is
+// aggregated over blocks of factor x factor pixels, taking both its minimum
+// and its maximum, and both coarse grids are searched first. Crossing a block
+// costs no less than with its minimum friction and no more than with its
+// maximum, so the two coarse costs bracket the cost of every pixel in the
+// block, once widened by the travel within the block and the origin block.
+//
+// A block is kept at coarse resolution when its bracket contains none of the
+// levels, so that it lies on the same side of every contour, and is narrower
+// than twice the maximum error. Its pixels take the middle of the bracket.
+// The other blocks are searched at full resolution, from the origin and from
+// the border pixels of the kept blocks around them. Every cost, and so every
+// contour, is then within the maximum error of the exact search. Friction
+// features smaller than a block, such as roads or rivers, widen the bracket
+// of their blocks, so they get refined rather than lost.
+struct pyramid_options_t {
+  int           _factor;    // side of the coarse blocks in pixels
+  float         _maxError;  // in costs of the first layer
+  std::vector<float> _levels;    // costs of the first layer whose contours are refined
+};
+
+inline std::unique_ptr<float[]>
+run_pyramid_layer(const tiled_layout_t& layout,
+                  const friction_data_t& friction,
+                  const friction_params_t& params,
+                  const float pixelWidthMeters,
+                  const float pixelHeightMeters,
+                  const int originX,
+                  const int originY,
+                  const float maxCost,
+                  const std::vector<float>& levels,
+                  const float maxError,
+                  const int factor,
+                  search_counters_t *counters,
+                  run_stats_t *stats,
+                  size_t layer)
+{
+  const int TILE = tiled_layout_t::TILE;
+  const int width = layout._width;
+  const int height = layout._height;
+  const row_major_layout_t coarse((width + factor - 1) / factor, (height + factor - 1) / factor);
+  const float unreached = 10 * maxCost;
+
+  phase_timer_t coarseTimer(stats, layer_phase("pyramid_coarse", layer));
+
+  // minimum and maximum effective friction of every block
+  std::unique_ptr<float[]> minFriction(new float[coarse.size()]);
+  std::unique_ptr<float[]> maxFriction(new float[coarse.size()]);
+  std::fill(minFriction.get(), minFriction.get() + coarse.size(), std::numeric_limits<float>::infinity());
+  std::fill(maxFriction.get(), maxFriction.get() + coarse.size(), 0.0f);
+  for (int y = 0; y < height; ++y) {
+    float *minRow = minFriction.get() + (size_t) (y / factor) * coarse._width;
+    float *maxRow = maxFriction.get() + (size_t) (y / factor) * coarse._width;
+    for (int x0 = 0; x0 < width; x0 += TILE) {
+      const float *src = friction.run(x0, y);
+      const int count = std::min(TILE, width - x0);
+      for (int i = 0; i < count; ++i) {
+        const float e = (src[i] == params._noData ? params._noDataFriction : std::max(src[i], params._minFriction)) * 0.5f;
+        const int bx = (x0 + i) / factor;
+        minRow[bx] = std::min(minRow[bx], e);
+        maxRow[bx] = std::max(maxRow[bx], e);
+      }
+    }
+  }
+
+  const float coarseWidth = pixelWidthMeters * factor;
+  const float coarseHeight = pixelHeightMeters * factor;
+  const int coarseOriginX = originX / factor;
+  const int coarseOriginY = originY / factor;
+  const float *pMinFriction = minFriction.get();
+  const float *pMaxFriction = maxFriction.get();
+  dense_grid_t<float> lower(coarse.size(), unreached);
+  dense_grid_t<float> upper(coarse.size(), unreached);
+  run_dijkstra_with_layout(coarse, lower, pMinFriction, coarseWidth, coarseHeight,
+                           coarseOriginX, coarseOriginY, maxCost, QUEUE_DARY);
+  run_dijkstra_with_layout(coarse, upper, pMaxFriction, coarseWidth, coarseHeight,
+                           coarseOriginX, coarseOriginY, maxCost, QUEUE_DARY);
+
+  // the effective friction (halved) times the block diagonal bounds the cost
+  // of going from any pixel of a block to its centre
+  const float blockDiagonal = std::sqrt(coarseWidth * coarseWidth + coarseHeight * coarseHeight);
+  const int origin = coarse.index(coarseOriginX, coarseOriginY);
+  const float originMinSlack = minFriction[origin] * blockDiagonal;
+  const float originMaxSlack = maxFriction[origin] * blockDiagonal;
+  std::vector<uint8_t> refine(coarse.size(), 0);
+  size_t refined = 0;
+  std::vector<float> blockCost(coarse.size(), unreached);
+  for (size_t b = 0; b < coarse.size(); ++b) {
+    const float low = lower.get(b) - minFriction[b] * blockDiagonal - originMinSlack;
+    if (low >= maxCost) continue;
+    const float high = upper.get(b) < maxCost
+      ? upper.get(b) + maxFriction[b] * blockDiagonal + originMaxSlack
+      : std::numeric_limits<float>::infinity();
+    auto level = std::lower_bound(levels.begin(), levels.end(), low);
+    refine[b] = (level != levels.end() && *level <= high) || high - low > 2 * maxError;
+    refined += refine[b];
+    blockCost[b] = refine[b] ? unreached : (low + high) / 2;
+  }
+  coarseTimer.stop();
+  if (stats != NULL) {
+    stats->add_counter("pyramid_blocks", coarse.size());
+    stats->add_counter("pyramid_blocks_refined", refined);
+  }
+
+  // kept blocks take the middle of their bracket, and the border pixels of
+  // those next to a refined block seed the full resolution search
+  dense_grid_t<float> cost(layout.size(), unreached);
+  dary_queue_t<dense_grid_t> queue(layout.size());
+  for (int by = 0; by < coarse._height; ++by) {
+    for (int bx = 0; bx < coarse._width; ++bx) {
+      const int b = coarse.index(bx, by);
+      if (refine[b] || blockCost[b] >= maxCost) continue;
+
+      bool seed = false;
+      for (int ny = std::max(0, by - 1); ny <= std::min(coarse._height - 1, by + 1) && !seed; ++ny) {
+        for (int nx = std::max(0, bx - 1); nx <= std::min(coarse._width - 1, bx + 1); ++nx) {
+          seed = seed || refine[coarse.index(nx, ny)];
+        }
+      }
+
+      const int x1 = bx * factor, x2 = std::min(width, x1 + factor);
+      const int y1 = by * factor, y2 = std::min(height, y1 + factor);
+      for (int y = y1; y < y2; ++y) {
+        for (int x = x1; x < x2; ++x) {
+          const int index = layout.index(x, y);
+          cost[index] = blockCost[b];
+          if (seed && (x == x1 || x == x2 - 1 || y == y1 || y == y2 - 1)) {
+            queue.push_or_decrease(index, blockCost[b]);
+            if (counters != NULL) counters->_pushes++;
+          }
+        }
+      }
+    }
+  }
+
+  lazy_effective_friction_t effectiveFriction(layout, friction, params);
+  run_dijkstra_with_queue(queue, layout, cost, effectiveFriction,
+                          pixelWidthMeters, pixelHeightMeters, originX, originY, maxCost, counters);
+  return row_major_costs(layout, cost);
+}
+
+// Searches every transport layer with the pyramid search, each on its own
+// thread, returning their costs over the whole friction data in row-major
+// order. The levels and maximum error are scaled to every layer by its
+// maximum cost.
+inline search_result_t
+run_pyramid_search(const friction_data_t& friction,
+                   const int width,
+                   const int height,
+                   const float frictionNoData,
+                   const float pixelWidthMeters,
+                   const float pixelHeightMeters,
+                   const int originX,
+                   const int originY,
+                   const std::vector<float>& maxCosts,
+                   const std::vector<float>& minFrictions,
+                   const pyramid_options_t& pyramid,
+                   unsigned threads = 1,
+                   run_stats_t *stats = NULL)
+{
+  if (pyramid._factor < 2) {
+    throw std::runtime_error("pyramid factor must be at least 2");
+  }
+
+  const tiled_layout_t layout(width, height);
+  const size_t layerCount = maxCosts.size();
+  search_result_t result;
+  result._window = { 0, 0, width, height };
+  result._costs.resize(layerCount);
+  parallel_for(layerCount, threads, [&](size_t i) {
+    const float scale = maxCosts[i] / maxCosts[0];
+    std::vector<float> levels;
+    for (float level : pyramid._levels) {
+      levels.push_back(level * scale);
+    }
+    std::sort(levels.begin(), levels.end());
+
+    phase_timer_t timer(stats, layer_phase("dijkstra", i));
+    search_counters_t counters;
+    result._costs[i] = run_pyramid_layer(layout, friction,
+                                         layer_friction_params(frictionNoData, maxCosts[i], minFrictions[i],
+                                                               pixelWidthMeters, pixelHeightMeters),
+                                         pixelWidthMeters, pixelHeightMeters, originX, originY, maxCosts[i],
+                                         levels, pyramid._maxError * scale, pyramid._factor,
+                                         &counters, stats, i);
+    timer.stop();
+    add_search_stats(stats, counters);
+  });
+  return result;
+}
+
+inline std::unique_ptr<float[]>
+load_friction_data(GDALDataset *pDataset, int rasterNumber, const raster_window_t& window, float *pNoData)
+{
+#ifdef BENCHMARK
+  boost::timer::auto_cpu_timer t(std::cerr, 6, "load_friction_data: %t sec CPU, %w sec real\n");
+#endif
+
+  GDALRasterBand *pRasterBand = pDataset->GetRasterBand(rasterNumber);
+  *pNoData = pRasterBand->GetNoDataValue();
+  std::unique_ptr<float[]> pData(new float[window._width * window._height]);
+
+  CPLErr result = pRasterBand->RasterIO(GF_Read,         // eRWFlag
+                                        window._xOff,    // nXOff
+                                        window._yOff,    // nYOff
+                                        window._width,   // nXSize
+                                        window._height,  // nYSize
+                                        pData.get(),     // pData
+                                        window._width,   // nBufXSize
+                                        window._height,  // nBufYSize
+                                        GDT_Float32,     // eBufType
+                                        0,               // nPixelSpace
+                                        0);              // nLineSpace
+
+  if (result != CE_None) {
+    throw std::runtime_error("failed to read friction raster data");
+  }
+
+  return pData;
+}
+
+// Window of the friction raster which can be reached from the origin by any
+// of the transport layers. Every step of the search costs at least
+// minFriction times its length, so nothing further than maxCost / minFriction
+// meters away can be reached. Two extra pixels are kept around so that the
+// relaxed (but not reachable) pixels and the surrounding unreached ones are
+// included, which keeps the contours closed as with the full raster.
+inline raster_window_t
+reachable_window(const raster_t& raster,
+                 const pixel_coords_t& origin,
+                 const std::vector<float>& maxTimeCost,
+                 const std::vector<float>& minFriction)
+{
+  const int margin = 2;
+  double radiusX = 0, radiusY = 0;
+  for (size_t i = 0; i < maxTimeCost.size(); ++i) {
+    if (minFriction[i] <= 0) {
+      return raster.full_window();
+    }
+    const double reach = maxTimeCost[i] / minFriction[i]; // meters
+    radiusX = std::max(radiusX, std::ceil(reach / raster.pixel_width_meters()));
+    radiusY = std::max(radiusY, std::ceil(reach / raster.pixel_height_meters()));
+  }
+
+  return raster.window_around(origin,
+                              (int) std::min<double>(radiusX + margin, raster.x_size()),
+                              (int) std::min<double>(radiusY + margin, raster.y_size()));
+}
+
+
+// Name and value of the metadata items written along with a raster.
+typedef std::vector<std::pair<std::string, std::string>> raster_metadata_t;
+
+// Writes a GeoTIFF of the window of the source raster, with a band of the
+// given type for every one of `bands`.
+inline void
+write_raster_layers(const std::string& filename, const raster_t& source, const raster_window_t& window,
+                    const std::vector<const void *>& bands, GDALDataType type, double noData,
+                    const raster_metadata_t& metadata = raster_metadata_t())
+{
+  const int width = window._width;
+  const int height = window._height;
+  const char *pszFormat = "GTiff";
+  GDALDriver *poDriver;
+  char **papszMetadata;
+
+  poDriver = GetGDALDriverManager()->GetDriverByName(pszFormat);
+  if (poDriver == NULL) {
+    throw std::runtime_error("cannot retrieve GeoTIFF driver");
+  }
+  papszMetadata = poDriver->GetMetadata();
+  if (!CSLFetchBoolean(papszMetadata, GDAL_DCAP_CREATE, FALSE)) {
+    throw std::runtime_error("driver cannot create new layers");
+  }
+
+  GDALDataset *pDataset;
+  char **ppOptions = NULL;
+  ppOptions = CSLSetNameValue(ppOptions, "COMPRESS", "DEFLATE");
+  // ppOptions = CSLSetNameValue(ppOptions, "PREDICTOR", "3");
+  pDataset = poDriver->Create(filename.c_str(), width, height, (int) bands.size(), type, ppOptions);
+  CSLDestroy(ppOptions);
+  if (pDataset == NULL) {
+    throw std::runtime_error("cannot create raster '" + filename + "'");
+  }
+
+  double geoTransform[6];
+  source.window_geo_transform(window, geoTransform);
+
+  pDataset->SetGeoTransform(geoTransform);
+  pDataset->SetProjection(source.projection().c_str());
+  for (auto& item : metadata) {
+    pDataset->SetMetadataItem(item.first.c_str(), item.second.c_str());
+  }
+
+  for (size_t i = 0; i < bands.size(); ++i) {
+    GDALRasterBand *pBand = pDataset->GetRasterBand((int) i + 1);
+    pBand->SetNoDataValue(noData);
+
+    CPLErr result = pBand->RasterIO(GF_Write,          // eRWFlag
+                                    0,                 // nXOff
+                                    0,                 // nYOff
+                                    width,             // nXSize
+                                    height,            // nYSize
+                                    (void *) bands[i], // pData
+                                    width,             // nBufXSize
+                                    height,            // nBufYSize
+                                    type,              // eBufType
+                                    0,                 // nPixelSpace
+                                    0);                // nLineSpace
+
+    if (result != CE_None) {
+      throw std::runtime_error("failed to write raster data to '" + filename + "'");
+    }
+  }
+
+  GDALClose(pDataset);
+}
+
+inline void
+write_raster_layer(const std::string& filename, const raster_t& source, const raster_window_t& window,
+                   const void *data, GDALDataType type, double noData,
+                   const raster_metadata_t& metadata = raster_metadata_t())
+{
+  write_raster_layers(filename, source, window, std::vector<const void *>(1, data), type, noData, metadata);
+}
+
+inline void
+write_cost_layer(const std::string& filename, const raster_t& source, const raster_window_t& window, const float data[],
+                 const raster_metadata_t& metadata = raster_metadata_t())
+{
+  write_raster_layer(filename, source, window, data, GDT_Float32, std::numeric_limits<float>::infinity(), metadata);
+}
+
+// Labels of the nearest origin, with NO_ORIGIN as nodata.
+inline void
+write_label_layer(const std::string& filename, const raster_t& source, const raster_window_t& window, const int32_t data[])
+{
+  write_raster_layer(filename, source, window, data, GDT_Int32, NO_ORIGIN);
+}
+
+
+// ======== Native friction files
+
+// Friction rasters converted for the search to read straight from a memory
+// mapping: a header with the raster metadata and projection, followed by the
+// float32 friction data in the tiled layout, uncompressed and in host byte
+// order. The data starts on a page boundary and every tile fills whole
+// pages, so the mapped pages can be shared through the page cache by every
+// process searching the same file.
+namespace {
+  const char NATIVE_FRICTION_MAGIC[8] = { 'W', 'C', 'F', 'R', 'I', 'C', 'T', 'N' };
+  const uint32_t NATIVE_FRICTION_VERSION = 1;
+  const uint32_t NATIVE_FRICTION_BYTE_ORDER = 0x01020304;
+  const size_t NATIVE_FRICTION_ALIGNMENT = 4096;
+  const char NATIVE_FRICTION_EXTENSION[] = ".friction";
+}
+
+struct native_friction_header_t {
+  char     _magic[8];
+  uint32_t _version;
+  uint32_t _byteOrder;
+  uint32_t _tileBits;
+  int32_t  _width;
+  int32_t  _height;
+  float    _noData;
+  double   _geoTransform[6];
+  uint64_t _projectionSize;  // bytes of projection WKT following the header
+  uint64_t _dataOffset;      // of the tiles, a multiple of the alignment
+};
+
+inline bool
+is_native_friction(const std::string& path)
+{
+  char magic[sizeof(NATIVE_FRICTION_MAGIC)];
+  std::ifstream input(path, std::ios::binary);
+  return input.read(magic, sizeof(magic)) && memcmp(magic, NATIVE_FRICTION_MAGIC, sizeof(magic)) == 0;
+}
+
+// Converts the first band of the dataset, reading it one row of tiles at a
+// time. The file is written under a temporary name and then renamed, so
+// readers never see a partial file.
+inline void
+write_native_friction(GDALDataset *pDataset, const std::string& path)
+{
+  const int TILE = tiled_layout_t::TILE;
+  GDALRasterBand *pBand = pDataset->GetRasterBand(1);
+  const int width = pDataset->GetRasterXSize();
+  const int height = pDataset->GetRasterYSize();
+  const tiled_layout_t layout(width, height);
+  const char *projection = pDataset->GetProjectionRef();
+
+  native_friction_header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header._magic, NATIVE_FRICTION_MAGIC, sizeof(header._magic));
+  header._version = NATIVE_FRICTION_VERSION;
+  header._byteOrder = NATIVE_FRICTION_BYTE_ORDER;
+  header._tileBits = tiled_layout_t::TILE_BITS;
+  header._width = width;
+  header._height = height;
+  header._noData = pBand->GetNoDataValue();
+  if (pDataset->GetGeoTransform(header._geoTransform) != CE_None) {
+    throw std::runtime_error("cannot get geotransform for raster");
+  }
+  header._projectionSize = projection != NULL ? strlen(projection) : 0;
+  header._dataOffset = (sizeof(header) + header._projectionSize + NATIVE_FRICTION_ALIGNMENT - 1)
+    / NATIVE_FRICTION_ALIGNMENT * NATIVE_FRICTION_ALIGNMENT;
+
+  // unique to every writer, so that concurrent conversions of the same
+  // raster do not write over each other before the rename
+  static std::atomic<unsigned> sequence(0);
+  const std::string tempPath = path + "." + std::to_string(getpid()) + "." + std::to_string(sequence++) + ".tmp";
+  std::ofstream output(tempPath, std::ios::binary | std::ios::trunc);
+  if (!output) {
+    throw std::runtime_error("cannot create '" + tempPath + "'");
+  }
+  output.write((const char *) &header, sizeof(header));
+  output.write(projection, header._projectionSize);
+  const std::vector<char> padding(header._dataOffset - sizeof(header) - header._projectionSize, 0);
+  output.write(padding.data(), padding.size());
+
+  // a row of tiles, padded with nodata at the right and bottom borders
+  const size_t tileSize = TILE * TILE;
+  std::unique_ptr<float[]> rows(new float[(size_t) TILE * width]);
+  std::unique_ptr<float[]> tiles(new float[layout._tilesX * tileSize]);
+  for (int ty = 0; ty < layout._tilesY; ++ty) {
+    const int rowCount = std::min(TILE, height - ty * TILE);
+    if (pBand->RasterIO(GF_Read, 0, ty * TILE, width, rowCount, rows.get(), width, rowCount,
+                        GDT_Float32, 0, 0) != CE_None) {
+      throw std::runtime_error("failed to read friction raster data");
+    }
+    std::fill(tiles.get(), tiles.get() + layout._tilesX * tileSize, header._noData);
+    for (int y = 0; y < rowCount; ++y) {
+      for (int tx = 0; tx < layout._tilesX; ++tx) {
+        const float *src = &rows[(size_t) y * width + tx * TILE];
+        std::copy(src, src + std::min(TILE, width - tx * TILE), &tiles[tx * tileSize + y * TILE]);
+      }
+    }
+    output.write((const char *) tiles.get(), layout._tilesX * tileSize * sizeof(float));
+  }
+
+  output.close();
+  if (!output) {
+    remove(tempPath.c_str());
+    throw std::runtime_error("failed to write '" + tempPath + "'");
+  }
+  if (rename(tempPath.c_str(), path.c_str()) != 0) {
+    remove(tempPath.c_str());
+    throw std::runtime_error("cannot rename '" + tempPath + "' to '" + path + "'");
+  }
+}
+
+// Native friction file mapped read-only in memory.
+class native_friction_t {
+  native_friction_header_t _header;
+  std::string _projection;
+  void *_map;
+  size_t _size;
+
+public:
+  explicit native_friction_t(const std::string& path) : _map(MAP_FAILED), _size(0) {
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::runtime_error("cannot open native friction file '" + path + "'");
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(_header)) {
+      _size = st.st_size;
+      _map = mmap(NULL, _size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (_map == MAP_FAILED) {
+      throw std::runtime_error("cannot map native friction file '" + path + "'");
+    }
+
+    memcpy(&_header, _map, sizeof(_header));
+    const tiled_layout_t layout(_header._width, _header._height);
+    if (memcmp(_header._magic, NATIVE_FRICTION_MAGIC, sizeof(_header._magic)) != 0
+        || _header._version != NATIVE_FRICTION_VERSION
+        || _header._byteOrder != NATIVE_FRICTION_BYTE_ORDER
+        || _header._tileBits != tiled_layout_t::TILE_BITS
+        || _header._dataOffset % NATIVE_FRICTION_ALIGNMENT != 0
+        || _header._dataOffset < sizeof(_header) + _header._projectionSize
+        || _size < _header._dataOffset + layout.size() * sizeof(float)) {
+      munmap(_map, _size);
+      throw std::runtime_error("invalid native friction file '" + path + "'");
+    }
+    _projection.assign((const char *) _map + sizeof(_header), _header._projectionSize);
+  }
+  ~native_friction_t() {
+    munmap(_map, _size);
+  }
+  native_friction_t(const native_friction_t&) = delete;
+  native_friction_t& operator=(const native_friction_t&) = delete;
+
+  const native_friction_header_t& header() const { return _header; }
+  const std::string& projection() const { return _projection; }
+  tiled_layout_t layout() const { return tiled_layout_t(_header._width, _header._height); }
+  const float *tiles() const { return (const float *) ((const char *) _map + _header._dataOffset); }
+};
+
+
+// ======== Contour algorithm
+
+#define xsect(p1,p2) (h[p2]*xh[p1]-h[p1]*xh[p2])/(h[p2]-h[p1])
+#define ysect(p1,p2) (h[p2]*yh[p1]-h[p1]*yh[p2])/(h[p2]-h[p1])
+
+typedef std::function<void(double,double,double,double,float)> contour_callback_t;
+
+/*
+Copyright (c) 1996-1997 Nicholas Yue
+
+This software is copyrighted by Nicholas Yue. This code is base on the work of
+Paul D. Bourke CONREC.F routine
+
+The authors hereby grant permission to use, copy, and distribute this
+software and its documentation for any purpose, provided that existing
+copyright notices are retained in all copies and that this notice is included
+verbatim in any distributions. Additionally, the authors grant permission to
+modify this software and its documentation for any purpose, provided that
+such modifications are not distributed without the explicit consent of the
+authors and that existing copyright notices are retained in all copies. Some
+of the algorithms implemented by this software are patented, observe all
+applicable patent law.
+
+IN NO EVENT SHALL THE AUTHORS OR DISTRIBUTORS BE LIABLE TO ANY PARTY FOR
+DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES ARISING OUT
+OF THE USE OF THIS SOFTWARE, ITS DOCUMENTATION, OR ANY DERIVATIVES THEREOF,
+EVEN IF THE AUTHORS HAVE BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+THE AUTHORS AND DISTRIBUTORS SPECIFICALLY DISCLAIM ANY WARRANTIES, INCLUDING,
+BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+PARTICULAR PURPOSE, AND NON-INFRINGEMENT.  THIS SOFTWARE IS PROVIDED ON AN
+"AS IS" BASIS, AND THE AUTHORS AND DISTRIBUTORS HAVE NO OBLIGATION TO PROVIDE
+MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+*/
+
+//=============================================================================
+//
+//     CONREC is a contouring subroutine for rectangularily spaced data.
+//
+//     It emits calls to a line drawing subroutine supplied by the user
+//     which draws a contour map corresponding to real*4data on a randomly
+//     spaced rectangular grid. The coordinates emitted are in the same
+//     units given in the x() and y() arrays.
+//
+//     Any number of contour levels may be specified but they must be
+//     in order of increasing value.
+//
+//     As this code is ported from FORTRAN-77, please be very careful of the
+//     various indices like ilb,iub,jlb and jub, remeber that C/C++ indices
+//     starts from zero (0)
+//
+//=============================================================================
+inline int conrec(const float * const *d,
+           int ilb,
+           int iub,
+           int jlb,
+           int jub,
+           double *x,
+           double *y,
+           int nc,
+           float *z,
+           const contour_callback_t& callback)
+// d               ! matrix of data to contour
+// ilb,iub,jlb,jub ! index bounds of data matrix
+// x               ! data matrix column coordinates
+// y               ! data matrix row coordinates
+// nc              ! number of contour levels
+// z               ! contour levels in increasing order
+{
+  int m1,m2,m3,case_value;
+  float dmin,dmax;
+  double x1,x2,y1,y2;
+  int i,j,k,m;
+  float h[5];
+  int sh[5];
+  double xh[5],yh[5];
+  //===========================================================================
+  // The indexing of im and jm should be noted as it has to start from zero
+  // unlike the fortran counter part
+  //===========================================================================
+  int im[4] = {0,1,1,0}, jm[4] = {0,0,1,1};
+  //===========================================================================
+  // Note that castab is arranged differently from the FORTRAN code because
+  // Fortran and C/C++ arrays are transposed of each other, in this case
+  // it is more tricky as castab is in 3 dimension
+  //===========================================================================
+  int castab[3][3][3] =
+    {
+      {
+        {0,0,8},{0,2,5},{7,6,9}
+      },
+      {
+        {0,3,4},{1,3,1},{4,3,0}
+      },
+      {
+        {9,6,7},{5,2,0},{8,0,0}
+      }
+    };
+  for (j=(jub-1);j>=jlb;j--) {
+    for (i=ilb;i<=iub-1;i++) {
+      float temp1,temp2;
+      temp1 = std::min(d[i][j],d[i][j+1]);
+      temp2 = std::min(d[i+1][j],d[i+1][j+1]);
+      dmin = std::min(temp1,temp2);
+      temp1 = std::max(d[i][j],d[i][j+1]);
+      temp2 = std::max(d[i+1][j],d[i+1][j+1]);
+      dmax = std::max(temp1,temp2);
+      if (dmax>=z[0]&&dmin<=z[nc-1]) {
+        for (k=0;k<nc;k++) {
+          if (z[k]>=dmin&&z[k]<=dmax) {
+            for (m=4;m>=0;m--) {
+              if (m>0) {
+                //=============================================================
+                // The indexing of im and jm should be noted as it has to
+                // start from zero
+                //=============================================================
+                h[m] = d[i+im[m-1]][j+jm[m-1]]-z[k];
+                xh[m] = x[i+im[m-1]];
+                yh[m] = y[j+jm[m-1]];
+              } else {
+                h[0] = 0.25*(h[1]+h[2]+h[3]+h[4]);
+                xh[0]=0.5*(x[i]+x[i+1]);
+                yh[0]=0.5*(y[j]+y[j+1]);
+              }
+              if (h[m]>0.0) {
+                sh[m] = 1;
+              } else if (h[m]<0.0) {
+                sh[m] = -1;
+              } else
+                sh[m] = 0;
+            }
+            //=================================================================
+            //
+            // Note: at this stage the relative heights of the corners and the
+            // centre are in the h array, and the corresponding coordinates are
+            // in the xh and yh arrays. The centre of the box is indexed by 0
+            // and the 4 corners by 1 to 4 as shown below.
+            // Each triangle is then indexed by the parameter m, and the 3
+            // vertices of each triangle are indexed by parameters m1,m2,and
+            // m3.
+            // It is assumed that the centre of the box is always vertex 2
+            // though this isimportant only when all 3 vertices lie exactly on
+            // the same contour level, in which case only the side of the box
+            // is drawn.
+            //
+            //
+            //      vertex 4 +-------------------+ vertex 3
+            //               | \               / |
+            //               |   \    m-3    /   |
+            //               |     \       /     |
+            //               |       \   /       |
+            //               |  m=2    X   m=2   |       the centre is vertex 0
+            //               |       /   \       |
+            //               |     /       \     |
+            //               |   /    m=1    \   |
+            //               | /               \ |
+            //      vertex 1 +-------------------+ vertex 2
+            //
+            //
+            //
+            //               Scan each triangle in the box
+            //
+            //=================================================================
+            for (m=1;m<=4;m++) {
+              m1 = m;
+              m2 = 0;
+              if (m!=4)
+                m3 = m+1;
+              else
+                m3 = 1;
+              case_value = castab[sh[m1]+1][sh[m2]+1][sh[m3]+1];
+              if (case_value!=0) {
+                switch (case_value) {
+                  //===========================================================
+                  //     Case 1 - Line between vertices 1 and 2
+                  //===========================================================
+                case 1:
+                  x1=xh[m1];
+                  y1=yh[m1];
+                  x2=xh[m2];
+                  y2=yh[m2];
+                  break;
+                  //===========================================================
+                  //     Case 2 - Line between vertices 2 and 3
+                  //===========================================================
+                case 2:
+                  x1=xh[m2];
+                  y1=yh[m2];
+                  x2=xh[m3];
+                  y2=yh[m3];
+                  break;
+                  //===========================================================
+                  //     Case 3 - Line between vertices 3 and 1
+                  //===========================================================
+                case 3:
+                  x1=xh[m3];
+                  y1=yh[m3];
+                  x2=xh[m1];
+                  y2=yh[m1];
+                  break;
+                  //===========================================================
+                  //     Case 4 - Line between vertex 1 and side 2-3
+                  //===========================================================
+                case 4:
+                  x1=xh[m1];
+                  y1=yh[m1];
+                  x2=xsect(m2,m3);
+                  y2=ysect(m2,m3);
+                  break;
+                  //===========================================================
+                  //     Case 5 - Line between vertex 2 and side 3-1
+                  //===========================================================
+                case 5:
+                  x1=xh[m2];
+                  y1=yh[m2];
+                  x2=xsect(m3,m1);
+                  y2=ysect(m3,m1);
+                  break;
+                  //===========================================================
+                  //     Case 6 - Line between vertex 3 and side 1-2
+                  //===========================================================
+                case 6:
+                  x1=xh[m3];
+                  y1=yh[m3];
+                  x2=xsect(m1,m2);
+                  y2=ysect(m1,m2);
+                  break;
+                  //===========================================================
+                  //     Case 7 - Line between sides 1-2 and 2-3
+                  //===========================================================
+                case 7:
+                  x1=xsect(m1,m2);
+                  y1=ysect(m1,m2);
+                  x2=xsect(m2,m3);
+                  y2=ysect(m2,m3);
+                  break;
+                  //===========================================================
+                  //     Case 8 - Line between sides 2-3 and 3-1
+                  //===========================================================
+                case 8:
+                  x1=xsect(m2,m3);
+                  y1=ysect(m2,m3);
+                  x2=xsect(m3,m1);
+                  y2=ysect(m3,m1);
+                  break;
+                  //===========================================================
+                  //     Case 9 - Line between sides 3-1 and 1-2
+                  //===========================================================
+                case 9:
+                  x1=xsect(m3,m1);
+                  y1=ysect(m3,m1);
+                  x2=xsect(m1,m2);
+                  y2=ysect(m1,m2);
+                  break;
+                default:
+                  throw std::runtime_error("unexpected contour case");
+                  break;
+                }
+                //=============================================================
+                // Put your processing code here and comment out the printf
+                //=============================================================
+                callback(x1, y1, x2, y2, z[k]);
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+inline bool
+coordsEqual(const coords_t& a, const coords_t& b) {
+  double df = a.first - b.first;
+  double ds = a.second - b.second;
+  return df * df + ds * ds < 1e-16;
+}
+
+// Builds the isochrone polygon out of closed rings, taking ownership of them
+inline OGRGeometry *
+build_polygon(const std::vector<OGRLinearRing *>& rings)
+{
+  OGRPolygon *result = new OGRPolygon();
+  std::vector<OGRLinearRing *> validRings;
+  int outerRing = -1;
+  int outerRingPoints = -1;
+  for (auto ring : rings) {
+    // this removes some extraneous artifacts from the contour algorithm which
+    // can later produce problems with PostGIS; a closed polygon *must* consist
+    // of at least 4 points
+    if (ring->getNumPoints() < 4) {
+      delete ring;
+      continue;
+    }
+    if (ring->getNumPoints() > outerRingPoints) {
+      outerRing = validRings.size();
+      outerRingPoints = ring->getNumPoints();
+    }
+    validRings.push_back(ring);
+  }
+
+  // use the ring with the greatest number of points as the outer ring
+  if (outerRing >= 0) {
+    result->addRingDirectly(validRings[outerRing]);
+    for (int i = 0; i < (int) validRings.size(); i++) {
+      if (i == outerRing) continue;
+      result->addRingDirectly(validRings[i]);
+    }
+  }
+
+  return result;
+}
+
+// Open addressing hash table from the open ends of contour sequences to the
+// vertex at that end. Coordinates are quantized to a grid much coarser than
+// the coordinate tolerance, and the neighbouring grid cells are only probed
+// for points close to a cell border. Several ends may share a key.
+class endpoint_index_t {
+  struct slot_t {
+    int64_t _kx;
+    int64_t _ky;
+    int32_t _vertex;
+  };
+
+  enum { EMPTY = -1, REMOVED = -2 };
+
+  std::vector<slot_t> _slots;
+  size_t _used = 0; // slots which are not EMPTY
+  size_t _live = 0;
+
+  static constexpr double QUANTUM = 1e-6;
+  static constexpr double TOLERANCE = 1e-8 / QUANTUM;
+
+  static inline size_t hash(int64_t kx, int64_t ky) {
+    uint64_t h = (uint64_t) kx * 0x9E3779B97F4A7C15ull ^ (uint64_t) ky * 0xC2B2AE3D27D4EB4Full;
+    return h ^ (h >> 29);
+  }
+
+  void rehash(size_t capacity) {
+    std::vector<slot_t> slots(capacity, slot_t { 0, 0, EMPTY });
+    _slots.swap(slots);
+    _used = _live = 0;
+    for (auto& slot : slots) {
+      if (slot._vertex >= 0) {
+        put(slot._kx, slot._ky, slot._vertex);
+      }
+    }
+  }
+
+  void put(int64_t kx, int64_t ky, int32_t vertex) {
+    const size_t mask = _slots.size() - 1;
+    size_t i = hash(kx, ky) & mask;
+    while (_slots[i]._vertex >= 0) {
+      i = (i + 1) & mask;
+    }
+    if (_slots[i]._vertex == EMPTY) _used++;
+    _slots[i] = slot_t { kx, ky, vertex };
+    _live++;
+  }
+
+public:
+  endpoint_index_t() {
+    rehash(64);
+  }
+
+  void insert(const coords_t& c, int32_t vertex) {
+    if ((_used + 1) * 2 > _slots.size()) {
+      rehash(_live * 4 > _slots.size() ? _slots.size() * 2 : _slots.size());
+    }
+    put(std::llround(c.first / QUANTUM), std::llround(c.second / QUANTUM), vertex);
+  }
+
+  void remove(const coords_t& c, int32_t vertex) {
+    const int64_t kx = std::llround(c.first / QUANTUM);
+    const int64_t ky = std::llround(c.second / QUANTUM);
+    const size_t mask = _slots.size() - 1;
+    for (size_t i = hash(kx, ky) & mask; _slots[i]._vertex != EMPTY; i = (i + 1) & mask) {
+      if (_slots[i]._vertex == vertex) {
+        _slots[i]._vertex = REMOVED;
+        _live--;
+        return;
+      }
+    }
+  }
+
+  // returns the first indexed vertex for which matches(vertex) is true, or -1
+  template<typename F>
+  int32_t find(const coords_t& c, const F& matches) const {
+    const double qx = c.first / QUANTUM;
+    const double qy = c.second / QUANTUM;
+    const int64_t kx = std::llround(qx);
+    const int64_t ky = std::llround(qy);
+    // offset from the cell center in [-0.5, 0.5]
+    const double fx = qx - kx;
+    const double fy = qy - ky;
+    const int dx1 = fx < TOLERANCE - 0.5 ? -1 : 0, dx2 = fx > 0.5 - TOLERANCE ? 1 : 0;
+    const int dy1 = fy < TOLERANCE - 0.5 ? -1 : 0, dy2 = fy > 0.5 - TOLERANCE ? 1 : 0;
+
+    const size_t mask = _slots.size() - 1;
+    for (int dx = dx1; dx <= dx2; ++dx) {
+      for (int dy = dy1; dy <= dy2; ++dy) {
+        for (size_t i = hash(kx + dx, ky + dy) & mask; _slots[i]._vertex != EMPTY; i = (i + 1) & mask) {
+          const slot_t& slot = _slots[i];
+          if (slot._vertex >= 0 && slot._kx == kx + dx && slot._ky == ky + dy && matches(slot._vertex)) {
+            return slot._vertex;
+          }
+        }
+      }
+    }
+    return -1;
+  }
+};
+
+// Stitches the unordered contour segments into sequences of points. All
+// vertices live in a single array, linked to their (up to two) neighbours
+// without orientation, so extending or joining sequences never moves or
+// reverses points; sequences are only walked from front to back when
+// building the polygon. Open ends are found through an endpoint index, so
+// every segment is added in constant time.
+struct contour_builder_t {
+  struct vertex_t {
+    coords_t _coords;
+    int32_t  _links[2];
+    int32_t  _sequence; // only kept up to date for the ends of a sequence
+  };
+
+  struct sequence_t {
+    int32_t _front;
+    int32_t _back;
+    bool    _closed;
+    bool    _merged;  // joined into another sequence
+  };
+
+  std::vector<vertex_t> _vertices;
+  std::vector<sequence_t> _sequences;
+  endpoint_index_t _ends;
+  int _segments = 0;
+
+  int32_t add_vertex(const coords_t& coords, int32_t link, int32_t sequence) {
+    vertex_t vertex = { coords, { link, -1 }, sequence };
+    _vertices.push_back(vertex);
+    return _vertices.size() - 1;
+  }
+
+  void link(int32_t a, int32_t b) {
+    _vertices[a]._links[_vertices[a]._links[0] < 0 ? 0 : 1] = b;
+    _vertices[b]._links[_vertices[b]._links[0] < 0 ? 0 : 1] = a;
+  }
+
+  int32_t find_end(const coords_t& point) const {
+    return _ends.find(point, [this, &point](int32_t vertex) {
+        return coordsEqual(point, _vertices[vertex]._coords);
+      });
+  }
+
+  // replaces the end vertex `end` of its sequence by `vertex`
+  void replace_end(int32_t end, int32_t vertex) {
+    sequence_t& seq = _sequences[_vertices[end]._sequence];
+    (seq._front == end ? seq._front : seq._back) = vertex;
+    _vertices[vertex]._sequence = _vertices[end]._sequence;
+    _ends.remove(_vertices[end]._coords, end);
+    _ends.insert(_vertices[vertex]._coords, vertex);
+  }
+
+  void extend(int32_t end, const coords_t& point) {
+    const int32_t vertex = add_vertex(point, end, _vertices[end]._sequence);
+    link(end, vertex);
+    replace_end(end, vertex);
+  }
+
+  void add_segment(const coords_t& a, const coords_t& b) {
+    _segments++;
+    if (coordsEqual(a, b)) return;
+
+    const int32_t endA = find_end(a);
+    const int32_t endB = find_end(b);
+
+    int c = (endA >= 0 ? 1 : 0) | (endB >= 0 ? 2 : 0);
+    switch (c) {
+    case 0: {
+      // new sequence
+      const int32_t sequence = _sequences.size();
+      const int32_t va = add_vertex(a, -1, sequence);
+      const int32_t vb = add_vertex(b, -1, sequence);
+      link(va, vb);
+      _sequences.push_back(sequence_t { va, vb, false, false });
+      _ends.insert(a, va);
+      _ends.insert(b, vb);
+      break;
+    }
+    case 1:
+      // extend the sequence ending at endA with b
+      extend(endA, b);
+      break;
+    case 2:
+      // extend the sequence ending at endB with a
+      extend(endB, a);
+      break;
+    case 3: {
+      const int32_t seqA = _vertices[endA]._sequence;
+      const int32_t seqB = _vertices[endB]._sequence;
+      _ends.remove(_vertices[endA]._coords, endA);
+      _ends.remove(_vertices[endB]._coords, endB);
+      if (seqA == seqB) {
+        // close the loop
+        _sequences[seqA]._closed = true;
+      } else {
+        // join the sequences, the far end of B becomes the end of A
+        sequence_t& a = _sequences[seqA];
+        sequence_t& b = _sequences[seqB];
+        const int32_t farB = b._front == endB ? b._back : b._front;
+        link(endA, endB);
+        (a._front == endA ? a._front : a._back) = farB;
+        _vertices[farB]._sequence = seqA;
+        b._merged = true;
+      }
+      break;
+    }
+    }
+  }
+
+  OGRGeometry *build() {
+    std::vector<OGRLinearRing *> rings;
+    for (auto& seq : _sequences) {
+      if (seq._merged) continue;
+
+      OGRLinearRing *ring = new OGRLinearRing();
+      int32_t previous = -1;
+      for (int32_t vertex = seq._front; ; ) {
+        ring->addPoint(_vertices[vertex]._coords.first, _vertices[vertex]._coords.second);
+        if (vertex == seq._back) break;
+        const int32_t *links = _vertices[vertex]._links;
+        const int32_t next = links[0] != previous ? links[0] : links[1];
+        previous = vertex;
+        vertex = next;
+      }
+      ring->closeRings();
+      rings.push_back(ring);
+    }
+
+    return build_polygon(rings);
+  }
+};
+
+// ======== Marching squares
+
+namespace {
+  // row and column offsets of the corners of a cell, clockwise from top-left
+  const int CORNER_ROW[4] = { 0, 0, 1, 1 };
+  const int CORNER_COL[4] = { 0, 1, 1, 0 };
+  // cell offsets when leaving a cell through its top, right, bottom or left edge
+  const int EDGE_ROW[4] = { -1, 0, 1, 0 };
+  const int EDGE_COL[4] = { 0, 1, 0, -1 };
+}
+
+// Traces the isolines of a single level over the cost grid by walking cell
+// edges, emitting every ring already closed and in order so no stitching is
+// needed. Cells are formed by four pixel centers; a pixel is inside if its
+// cost is below the level, and the grid is padded with outside pixels so
+// that rings reaching the raster border close along the border pixels.
+//
+// Going clockwise around a cell, every edge crossed from outside to inside
+// is an entry and every edge crossed from inside to outside is an exit; the
+// exit of a cell is the entry of its neighbour, so following entries always
+// comes back to the starting edge. Saddle cells are resolved with the mean
+// of their corners: if it is inside, the inside corners are joined.
+inline std::vector<OGRLinearRing *>
+trace_isolines(const float *data, int width, int height,
+               const coords_t& topLeft, double dLng, double dLat, float level)
+{
+  const float outside = std::numeric_limits<float>::infinity();
+  auto value = [&](int r, int c) -> float {
+    return (r < 0 || c < 0 || r >= height || c >= width) ? outside : data[c + (size_t) width * r];
+  };
+  // loads the corner values of cell r,c and returns a bitmask of inside corners
+  auto load = [&](int r, int c, float v[4]) -> unsigned {
+    unsigned inside = 0;
+    for (int k = 0; k < 4; ++k) {
+      v[k] = value(r + CORNER_ROW[k], c + CORNER_COL[k]);
+      inside |= (v[k] < level ? 1u : 0u) << k;
+    }
+    return inside;
+  };
+  auto is_entry = [](unsigned inside, int e) -> bool {
+    return !((inside >> e) & 1) && ((inside >> ((e + 1) & 3)) & 1);
+  };
+  auto exit_for = [&](unsigned inside, const float v[4], int entry) -> int {
+    if (inside == 5 || inside == 10) {
+      const float center = (v[0] + v[1] + v[2] + v[3]) / 4;
+      return center < level ? (entry + 3) & 3 : (entry + 1) & 3;
+    }
+    for (int k = 0; k < 4; ++k) {
+      if (((inside >> k) & 1) && !((inside >> ((k + 1) & 3)) & 1)) return k;
+    }
+    throw std::runtime_error("unexpected marching squares case");
+  };
+
+  const size_t rowCells = width + 1;
+  std::vector<uint8_t> visited(rowCells * (height + 1), 0);
+  auto cell = [&](int r, int c) -> size_t { return (c + 1) + rowCells * (r + 1); };
+
+  std::vector<OGRLinearRing *> rings;
+  std::vector<coords_t> points;
+  for (int r0 = -1; r0 < height; ++r0) {
+    for (int c0 = -1; c0 < width; ++c0) {
+      float v[4];
+      const unsigned inside0 = load(r0, c0, v);
+      if (inside0 == 0 || inside0 == 15) continue;
+
+      for (int e0 = 0; e0 < 4; ++e0) {
+        if (!is_entry(inside0, e0) || (visited[cell(r0, c0)] >> e0) & 1) continue;
+
+        points.clear();
+        int r = r0, c = c0, e = e0;
+        do {
+          visited[cell(r, c)] |= 1 << e;
+          const unsigned inside = load(r, c, v);
+
+          // interpolate from the inside corner of the entry edge, so that an
+          // outside padding corner yields the border pixel center itself
+          const int ki = (e + 1) & 3;
+          const int ko = e;
+          const double t = ((double) level - v[ki]) / ((double) v[ko] - v[ki]);
+          const double latIn = topLeft.second + dLat * (r + CORNER_ROW[ki] + 0.5);
+          const double lngIn = topLeft.first + dLng * (c + CORNER_COL[ki] + 0.5);
+          const coords_t point = make_coords(lngIn + t * dLng * (CORNER_COL[ko] - CORNER_COL[ki]),
+                                             latIn + t * dLat * (CORNER_ROW[ko] - CORNER_ROW[ki]));
+          if (points.empty() || point != points.back()) {
+            points.push_back(point);
+          }
+
+          const int x = exit_for(inside, v, e);
+          r += EDGE_ROW[x];
+          c += EDGE_COL[x];
+          e = (x + 2) & 3;
+        } while (r != r0 || c != c0 || e != e0);
+
+        if (points.size() > 1 && points.front() == points.back()) {
+          points.pop_back();
+        }
+        OGRLinearRing *ring = new OGRLinearRing();
+        for (auto& point : points) {
+          ring->addPoint(point.first, point.second);
+        }
+        ring->closeRings();
+        rings.push_back(ring);
+      }
+    }
+  }
+
+  return rings;
+}
+
+
+// ======== Isochrone extraction
+
+// Contours every level (in increasing order) returning one polygon per level.
+// CONREC contours all of them in a single sweep over the cost surface, while
+// marching squares traces each level separately. Contouring and polygon
+// building are timed separately in `stats` if given.
+inline std::vector<std::unique_ptr<OGRGeometry>>
+extract_isochrones(const float *data, int width, int height, const coords_t& topLeft, const coords_t& bottomRight,
+                   const std::vector<float>& times, contour_kind_t contourKind = CONTOUR_CONREC,
+                   run_stats_t *stats = NULL)
+{
+#ifdef BENCHMARK
+  boost::timer::auto_cpu_timer t(std::cerr, 6, "extract_isochrone: %t sec CPU, %w sec real\n");
+#endif
+
+  std::vector<std::unique_ptr<OGRGeometry>> polygons;
+
+  if (contourKind == CONTOUR_MARCHING_SQUARES) {
+    const double dLat = (bottomRight.second - topLeft.second) / height;
+    const double dLng = (bottomRight.first - topLeft.first) / width;
+    for (float time : times) {
+      phase_timer_t contourTimer(stats, "contour");
+      std::vector<OGRLinearRing *> rings = trace_isolines(data, width, height, topLeft, dLng, dLat, time);
+      contourTimer.stop();
+      phase_timer_t buildTimer(stats, "build");
+      polygons.emplace_back(build_polygon(rings));
+    }
+    return polygons;
+  }
+
+  std::unique_ptr<const float *[]> dataRows(new const float *[height]);
+  const float *p = data;
+  for (int i = 0; i < height; i++, p += width) {
+    dataRows[i] = p;
+  }
+  std::unique_ptr<double[]> latitudes(new double[height]);
+  std::unique_ptr<double[]> longitudes(new double[width]);
+  double dLat = (bottomRight.second - topLeft.second) / height;
+  double lat = topLeft.second + dLat / 2;
+  for (int i = 0; i < height; i++, lat += dLat) {
+    latitudes[i] = lat;
+  }
+  double dLng = (bottomRight.first - topLeft.first) / width;
+  double lng = topLeft.first + dLng / 2;
+  for (int i = 0; i < width; i++, lng += dLng) {
+    longitudes[i] = lng;
+  }
+  std::vector<float> levels(times);
+
+  std::vector<contour_builder_t> builders(levels.size());
+  auto callback = [&builders, &levels](double x1, double y1, double x2, double y2, float z) {
+    size_t k = std::find(levels.begin(), levels.end(), z) - levels.begin();
+    builders[k].add_segment(make_coords(y1, x1), make_coords(y2, x2));
+  };
+
+  // the segments are stitched as CONREC emits them
+  phase_timer_t contourTimer(stats, "contour");
+  conrec(dataRows.get(),
+         0, height - 1, 0, width - 1,
+         latitudes.get(), longitudes.get(),
+         levels.size(), levels.data(),
+         callback);
+  contourTimer.stop();
+
+  phase_timer_t buildTimer(stats, "build");
+  for (auto& builder : builders) {
+    polygons.emplace_back(builder.build());
+    if (stats != NULL) {
+      stats->add_counter("contour_segments", builder._segments);
+    }
+  }
+  return polygons;
+}
+
+// ======== Population under coverage
+
+// Population of the pixels reached within each of the levels (given in
+// increasing order). The cost surface is resampled onto the population grid
+// by nearest neighbour: every population pixel takes the cost of the cost
+// pixel under its centre, and is not reached if its centre falls outside
+// the cost surface. Both grids are row-major and north-up, with their
+// geotransforms in the same coordinate system.
+inline std::vector<double>
+population_under_costs(const float* cost, int costWidth, int costHeight, const double costTransform[6],
+                       const float* population, int popWidth, int popHeight, const double popTransform[6],
+                       float popNoData, const std::vector<float>& levels)
+{
+#ifdef BENCHMARK
+  boost::timer::auto_cpu_timer t(std::cerr, 6, "population_under_costs: %t sec CPU, %w sec real\n");
+#endif
+
+  // cost column and row under the centre of every population column and row
+  std::vector<int> costColumns(popWidth), costRows(popHeight);
+  for (int x = 0; x < popWidth; ++x) {
+    const double lng = popTransform[0] + (x + 0.5) * popTransform[1];
+    const double cx = std::floor((lng - costTransform[0]) / costTransform[1]);
+    costColumns[x] = (cx >= 0 && cx < costWidth) ? (int) cx : -1;
+  }
+  for (int y = 0; y < popHeight; ++y) {
+    const double lat = popTransform[3] + (y + 0.5) * popTransform[5];
+    const double cy = std::floor((lat - costTransform[3]) / costTransform[5]);
+    costRows[y] = (cy >= 0 && cy < costHeight) ? (int) cy : -1;
+  }
+
+  // population reached first within each level, accumulated at the end
+  const float maxLevel = levels.back();
+  std::vector<double> covered(levels.size(), 0.0);
+  for (int y = 0; y < popHeight; ++y) {
+    if (costRows[y] < 0) continue;
+    const float *costRow = cost + (size_t) costRows[y] * costWidth;
+    const float *popRow = population + (size_t) y * popWidth;
+    for (int x = 0; x < popWidth; ++x) {
+      const float value = popRow[x];
+      if (costColumns[x] < 0 || value == popNoData || value != value) continue;
+      const float c = costRow[costColumns[x]];
+      if (c <= maxLevel) {
+        covered[std::lower_bound(levels.begin(), levels.end(), c) - levels.begin()] += value;
+      }
+    }
+  }
+  for (size_t i = 1; i < covered.size(); ++i) {
+    covered[i] += covered[i - 1];
+  }
+  return covered;
+}
+
+inline void
+merge_cost_layer(float base[], const float layer[], size_t size, float baseCost, float layerCost)
+{
+  for (size_t i=0; i<size; ++i) {
+    base[i] = std::min(base[i], baseCost * layer[i] / layerCost);
+  }
+}
+
+// Merges all layers into base as merge_cost_layers(), and the labels of the
+// layers into baseLabels where their scaled costs are taken.
+inline void
+merge_labelled_cost_layers(float base[], int32_t baseLabels[],
+                           const std::vector<const float *>& layers, const std::vector<const int32_t *>& layerLabels,
+                           int width, int height, float baseCost, const std::vector<float>& layerCosts)
+{
+  const size_t size = (size_t) width * height;
+  for (size_t k = 0; k < layers.size(); ++k) {
+    for (size_t i = 0; i < size; ++i) {
+      const float cost = baseCost * layers[k][i] / layerCosts[k];
+      if (cost < base[i]) {
+        base[i] = cost;
+        baseLabels[i] = layerLabels[k][i];
+      }
+    }
+  }
+}
+
+// Merges all layers into base in a single pass, scaling each one by
+// baseCost / layerCosts[k]. The raster is split in chunks small enough to
+// stay in cache while every layer is merged into them, and the chunks are
+// spread over the given number of threads.
+inline void
+merge_cost_layers(float base[], const std::vector<const float *>& layers, int width, int height,
+                  float baseCost, const std::vector<float>& layerCosts, unsigned threads)
+{
+  const size_t chunkSize = 16384;
+  const size_t size = (size_t) width * height;
+  const size_t chunks = (size + chunkSize - 1) / chunkSize;
+
+  parallel_for(chunks, threads, [&](size_t chunk) {
+    const size_t offset = chunk * chunkSize;
+    const size_t count = std::min(chunkSize, size - offset);
+    for (size_t k = 0; k < layers.size(); ++k) {
+      merge_cost_layer(base + offset, layers[k] + offset, count, baseCost, layerCosts[k]);
+    }
+  });
+}
+
+#endif // WALKING_COVERAGE_H
@@ -77,10 +77,10 @@
 (defn remove-unused-scenario-files
   [{:keys [id raster] :as scenario} scenario-result-after-computation]
   (when (some? raster)
-    (io/delete-file (io/file (str "data/" raster ".tif")) :silent)
-    (io/delete-file (io/file (str "data/" raster ".map.tif")) :silent)
-    (io/delete-file (io/file (str "data/" raster ".coverage.tif")) :silent)
-    (io/delete-file (io/file (str "data/" raster ".base-demand.tif")) :silent)))
+    (doseq [suffix [".tif" ".map.tif" ".coverage.tif" ".base-demand.tif"]]
+      (io/delete-file (io/file (str "data/" raster suffix)) :silent)
+      ;; result cached by aggregate-population next to the raster
+      (io/delete-file (io/file (str "data/" raster suffix ".aggregate-cache")) :silent))))
 
 ;; ----------------------------------------------------------------------
 ;; Service definition